@@ -109,6 +109,7 @@ MeanShift::MeanShift( void )
 
 	//indicate that the lattice weight map is undefined
 	weightMapDefined			= false;
+	inputVersion				= 0;
 	
 	//allocate memory for error message buffer...
 	ErrorMessage				= new char [256];
@@ -435,6 +436,16 @@ void MeanShift::DefineInput(float *x, int L_, int N_)
 
 void MeanShift::DefineLInput(float *x, int ht, int wt, int N_)
 {
+
+	//the same input with zero weight map does not invalidate
+	//lattices cached by msImageProcessor
+	bool sameInput = class_state.LATTICE_DEFINED && data && weightMap && (ht == height) && (wt == width) && (N_ == N);
+	for(int i = 0; sameInput && (i < L*N); i++)
+		sameInput = (data[i] == x[i]);
+	for(int i = 0; sameInput && (i < L); i++)
+		sameInput = (weightMap[i] == 0);
+	if(!sameInput)
+		inputVersion++;
 	
 	//if input data is defined de-allocate memory, and
 	//re-initialize the input data structure
@@ -517,6 +528,7 @@ void MeanShift::SetLatticeWeightMap(float *wm)
 	int i;
 	for(i = 0; i < L; i++)
 		weightMap[i] = wm[i];
+	inputVersion++;
 
 	//indicate that a lattice weight map has been specified
 	weightMapDefined	= true;
@@ -547,6 +559,7 @@ void MeanShift::RemoveLatticeWeightMap(void)
 	{
 		//set values of lattice weight map to zero
 		memset(weightMap, 0, L*sizeof(float));
+		inputVersion++;
 
 		//indicate that a lattice weight map is no longer
 		//defined
@@ -788,6 +788,9 @@ class MeanShift {
 	bool			weightMapDefined;					// used to indicate if a lattice weight map has been
 														// defined
 
+	unsigned int	inputVersion;						// changes whenever input data or lattice weight map change
+														// (lattices cached by msImageProcessor are rebuilt then)
+
    //##########################################
    //#######        CLASS STATE        ########
    //##########################################
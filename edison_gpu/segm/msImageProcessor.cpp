@@ -36,12 +36,20 @@ Implemented by Chris M. Christoudias, Bogdan Georgescu
 //include image processor class prototype
 #include	"msImageProcessor.h"
 
+#include	"../src/timer.h"
+#include	"../src/ms_work_stealing.h"
+#include	"../src/ms_cpu_kernels.h"
+#include	"../src/ms_lattice.h"
+#include	"../src/ms_flat_regions.h"
+
 //include needed libraries
 #include	<math.h>
 #include	<stdio.h>
 #include	<assert.h>
 #include	<string.h>
 #include	<stdlib.h>
+#include	<vector>
+#include	<algorithm>
 
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
@@ -105,6 +113,28 @@ msImageProcessor::msImageProcessor( void )
 
 //Changed by Sushil from 1.0 to 0.1, 11/11/2008
    LUV_treshold = 0.1;
+
+	//initialize speed threshold used by HIGH_SPEEDUP
+	//filter (0 keeps the results HIGH_SPEEDUP had when it was
+	//left uninitialized, EDISON system uses 0.1 - see SetSpeedThreshold)
+	speedThreshold	= (float) 0.0;
+
+	//no filtering was done yet
+	filterStatistics.preprocessingTime	= 0;
+	filterStatistics.filterTime			= 0;
+	filterStatistics.connectTime		= 0;
+	filterStatistics.candidatesExamined	= 0;
+	filterStatistics.candidatesAccepted	= 0;
+	filterStatistics.iterations			= 0;
+	filterStatistics.iterationsLimit	= LIMIT;
+	filterStatistics.flatPixels			= 0;
+	filterControl						= nullptr;
+
+	//nothing is cached yet
+	definedImageType					= GRAYSCALE;
+	cachedLatticeDouble.lattice			= nullptr;
+	cachedLatticeFloat.lattice			= nullptr;
+	cachedFlatRegions.flatRegions		= nullptr;
 }
 
 /*******************************************************/
@@ -163,24 +193,32 @@ void msImageProcessor::DefineImage(const byte *data_, imageType type, int height
 	else
 		dim = 1;
 
-	//perfor rgb to luv conversion
+	//perfor rgb to luv conversion (unless the same image was converted
+	//by the last call)
 	int		i;
-	float	*luv	= new float [height_*width_*dim];
-	if(dim == 1)
-	{
-		for(i = 0; i < height_*width_; i++)
-			luv[i]	= (float)(data_[i]);
-	}
-	else
+	const size_t	size	= (size_t) height_*width_*dim;
+	if((type != definedImageType)||(definedImage.size() != size)||!std::equal(definedImage.begin(), definedImage.end(), data_))
 	{
-		for(i = 0; i < height_*width_; i++)
+		definedImage.assign(data_, data_ + size);
+		definedImageType	= type;
+		definedLuv.resize(size);
+		float	*luv	= definedLuv.data();
+		if(dim == 1)
 		{
-				RGBtoLUV(&data_[dim*i], &luv[dim*i]);
+			for(i = 0; i < height_*width_; i++)
+				luv[i]	= (float)(data_[i]);
+		}
+		else
+		{
+			//converted by the kernel of the instruction set selected at startup
+			//(equal to RGBtoLUV of each pixel)
+			cpuKernels().rgbToLuv(data_, luv, height_*width_);
 		}
 	}
 
 	//define input defined on a lattice using mean shift base class
-	DefineLInput(luv, height_, width_, dim);
+	//(the same input keeps cached lattices, see MeanShift::inputVersion)
+	DefineLInput(definedLuv.data(), height_, width_, dim);
 
 	//Define a default kernel if it has not been already
 	//defined by user
@@ -195,9 +233,6 @@ void msImageProcessor::DefineImage(const byte *data_, imageType type, int height
 		DefineKernel(k, tempH, P, 2);
 	}
 
-	//de-allocate memory
-	delete [] luv;
-
 	//done.
 	return;
 
@@ -225,9 +260,7 @@ void msImageProcessor::DefineBgImage(byte* data_, imageType type, int height_, i
 	}
 	else
 	{
-		for(i = 0; i < height_*width_; i++)
-			RGBtoLUV(&data_[dim*i], &luv[dim*i]);
-		
+		cpuKernels().rgbToLuv(data_, luv, height_*width_);
 	}
 
 	//define input defined on a lattice using mean shift base class
@@ -349,6 +382,11 @@ void msImageProcessor::RemoveWeightMap( void )
 /*******************************************************/
 
 void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLevel)
+{
+	FilterWithOptions((float) sigmaS, sigmaR, speedUpLevel, nullptr);
+}
+
+void msImageProcessor::FilterWithOptions(float sigmaS, float sigmaR, SpeedUpLevel speedUpLevel, const OmpFilterOptions* options, bool startControl)
 {
 
 	//Check Class consistency...
@@ -384,6 +422,14 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 			return;
 	}
 
+	//new filters are specialized at compile time for grayscale
+	//and color images (see NewOptimizedFilter1 for example)...
+	if((N != 1)&&(N != 3)&&(speedUpLevel != NO_SPEEDUP))
+	{
+		ErrorHandler("msImageProcessor", "Filter", "Only grayscale and color images are supported by this speedup level.");
+		return;
+	}
+
 	//****************** Allocate Memory ******************
 
 	//Allocate memory for basin of attraction mode structure...
@@ -401,6 +447,20 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 
 	//*****************************************************
 
+	//reset statistics (preprocessing time is reported by filters)...
+	filterStatistics.preprocessingTime	= 0;
+	filterStatistics.filterTime			= 0;
+	filterStatistics.connectTime		= 0;
+	filterStatistics.candidatesExamined	= 0;
+	filterStatistics.candidatesAccepted	= 0;
+	filterStatistics.iterations			= 0;
+	filterStatistics.iterationsLimit	= LIMIT;
+	filterStatistics.flatPixels			= 0;
+	filterStatistics.threadsIdleTime.clear();
+	if (filterControl && startControl)
+		filterControl->Start(L);
+	performance_timer filterTimer;
+
 	//filter image according to speedup level...
 	switch(speedUpLevel)
 	{
@@ -419,9 +479,20 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
       //OptimizedFilter2((float)(sigmaS), sigmaR);		break;
       NewOptimizedFilter2((float)(sigmaS), sigmaR);		
 	  break;
+	//multithreaded medium speedup
+	case MED_MULTITHREADED_SPEEDUP:
+      NewOptimizedFilter1((float)(sigmaS), sigmaR, true);
+	  break;
+	//multithreaded high speedup
+	case HIGH_MULTITHREADED_SPEEDUP:
+      NewOptimizedFilter2((float)(sigmaS), sigmaR, true);
+	  break;
 	//multithreaded speedup
 	case MULTITHREADED_SPEEDUP: 
-      NewNonOptimizedFilter_omp((float)(sigmaS), sigmaR);
+      if (options)
+         NewNonOptimizedFilter_omp_options((float)(sigmaS), sigmaR, nullptr, *options);
+      else
+         NewNonOptimizedFilter_omp((float)(sigmaS), sigmaR);
 	  break;
 	//OpenCL GPU speedup
 	case GPU_SPEEDUP: 
@@ -431,8 +502,45 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 	case AUTO_SPEEDUP: 
       NewNonOptimizedFilter_auto((float)(sigmaS), sigmaR);
 	  break;
+	//single precision multithreaded speedup
+	case MULTITHREADED_FLOAT_SPEEDUP:
+      NewNonOptimizedFilter_omp_float((float)(sigmaS), sigmaR);
+	  break;
+	//multithreaded speedup with candidates gathered by tiles
+	case MULTITHREADED_TILED_SPEEDUP:
+      NewNonOptimizedFilter_omp_tiled((float)(sigmaS), sigmaR);
+	  break;
+	//multithreaded speedup with 5D buckets
+	case MULTITHREADED_5D_SPEEDUP:
+      NewNonOptimizedFilter_omp_5d((float)(sigmaS), sigmaR);
+	  break;
+	//multithreaded speedup with coarse-to-fine warm start
+	case MULTITHREADED_PYRAMID_SPEEDUP:
+      NewNonOptimizedFilter_omp_pyramid((float)(sigmaS), sigmaR);
+	  break;
+	//approximate multithreaded speedup with bilateral grid
+	case BILATERAL_GRID_SPEEDUP:
+      NewNonOptimizedFilter_grid((float)(sigmaS), sigmaR);
+	  break;
+	//approximate multithreaded speedup with bin seeding
+	case MULTITHREADED_BIN_SEEDED_SPEEDUP:
+      NewNonOptimizedFilter_omp_binseeded((float)(sigmaS), sigmaR);
+	  break;
+	//approximate multithreaded speedup with quantized points
+	case QUANTIZED_SPEEDUP:
+      NewNonOptimizedFilter_quantized((float)(sigmaS), sigmaR);
+	  break;
+	//approximate multithreaded speedup with shared windows of almost flat tiles
+	case MULTITHREADED_FLAT_TILES_SPEEDUP:
+      NewNonOptimizedFilter_omp_flat((float)(sigmaS), sigmaR);
+	  break;
+	//OpenCL GPU speedup with persistent workgroups
+	case GPU_PERSISTENT_SPEEDUP:
+      NewNonOptimizedFilter_gpu((float)(sigmaS), sigmaR, nullptr, nullptr, nullptr, nullptr, cl::Device_ptr(), true);
+	  break;
    // new speedup
 	}
+	filterStatistics.filterTime = filterTimer.elapsed();
 
 	//****************** Deallocate Memory ******************
 
@@ -487,7 +595,9 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 #endif
 	
 	//Perform connecting (label image regions) using LUV_data
+	performance_timer connectTimer;
 	Connect();
+	filterStatistics.connectTime = connectTimer.elapsed();
 	
 #ifdef PROMPT
 	timer	= msSys.ElapsedTime();
@@ -1974,6 +2084,11 @@ void msImageProcessor::Connect( void )
 		modePointCounts[i]	=  0;
 	}
 
+	//compare colors of neighbours once for the whole image
+	//(by the kernel of the instruction set selected at startup)
+	std::vector<unsigned char> similarityMasks(width*height);
+	cpuKernels().similarityMasks(LUV_data, N, width*height, width, LUV_treshold, similarityMasks.data());
+
 	//Traverse the image labeling each new region encountered
 	int k, label = -1;
 	for(i = 0; i < height*width; i++)
@@ -1991,7 +2106,7 @@ void msImageProcessor::Connect( void )
 
 			//populate labels with label for this specified region
 			//calculating modePointCounts[label]...
-			Fill(i, label);
+			Fill(i, label, similarityMasks.data());
 		}
 	}
 
@@ -2015,6 +2130,9 @@ void msImageProcessor::Connect( void )
 /*      - regionLoc is a region seed - a pixel that is */
 /*        identified as being part of the region       */
 /*        labled using the label, label.               */
+/*      - similarityMasks are bit masks of neighbours  */
+/*        with similar colors (see CpuKernels::        */
+/*        similarityMasks)                             */
 /*Post:                                                */
 /*      - all pixels belonging to the region specified */
 /*        by regionLoc (having the same integer LUV    */
@@ -2024,11 +2142,16 @@ void msImageProcessor::Connect( void )
 /*        via an eight-connected fill.                 */
 /*******************************************************/
 
-void msImageProcessor::Fill(int regionLoc, int label)
+void msImageProcessor::Fill(int regionLoc, int label, const unsigned char* similarityMasks)
 {
 
 	//declare variables
-	int	i, k, neighLoc, neighborsFound, imageSize	= width*height;
+	int	i, neighLoc, neighborsFound, imageSize	= width*height;
+
+	//neighbour i is similar if bit similarityBit[i] is set in the mask of regionLoc (for neighbours
+	//that follow regionLoc), or in the mask of the neighbour (for neighbours that precede regionLoc)
+	static const int similarityBit[8]	= {0, 1, 2, 3, 0, 1, 2, 3};
+	static const bool followsRegionLoc[8]	= {true, false, false, false, false, true, true, true};
 
 	//Fill region starting at region location
 	//using labels...
@@ -2066,17 +2189,13 @@ void msImageProcessor::Fill(int regionLoc, int label)
 			neighLoc			= regionLoc + neigh[i];
 			if((neighLoc >= 0)&&(neighLoc < imageSize)&&(labels[neighLoc] < 0))
 			{
-				for(k = 0; k < N; k++)
-				{
-//					if(LUV_data[(regionLoc*N)+k] != LUV_data[(neighLoc*N)+k])
-               if (fabs(LUV_data[(regionLoc*N)+k]-LUV_data[(neighLoc*N)+k])>=LUV_treshold)
-						break;
-				}
-				
+				//fabs(LUV_data[regionLoc*N+k]-LUV_data[neighLoc*N+k]) < LUV_treshold for all k
+				const unsigned char mask = similarityMasks[followsRegionLoc[i] ? regionLoc : neighLoc];
+
 				//neighbor i belongs to this region so label it and
 				//place it onto the index table buffer for further
 				//processing
-				if(k == N)
+				if((mask >> similarityBit[i]) & 1)
 				{
 					//assign label to neighbor i
 					labels[neighLoc]	= label;
@@ -3463,11 +3582,70 @@ void msImageProcessor::DestroyOutput( void )
 }
 
 // NEW
-void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
+//approximate number of pixels in a block owning a part of the mode table
+//in multithreaded versions of NewOptimizedFilter1 and NewOptimizedFilter2
+#define BASIN_BLOCK_PIXELS	16384
+//minimal height of such block in search window radii (sigmaS), so that most
+//of basins of attraction do not cross boundaries of blocks
+#define BASIN_BLOCK_WINDOWS	8
+
+//Processes bands of rows with processBlock(blockFrom, blockTo, joinFrom, joinTo) on the work stealing pool
+//in two passes: even bands first, then odd ones. A band owns its part of modeTable, but pixels of odd bands
+//can also join basins of attraction already found in [joinFrom, joinTo) - in the neighbouring even bands.
+//Band height depends only on the image size and sigmaS, so results do not depend on number of threads
+//and order of blocks processing. Returns idle time of each thread.
+template <typename ProcessBlock>
+static std::vector<double> processBasinBands(int width, int height, float sigmaS, const ProcessBlock &processBlock)
+{
+	const int rows = std::max(1, std::min(height, std::max(BASIN_BLOCK_PIXELS / width, (int) ceil(BASIN_BLOCK_WINDOWS * sigmaS))));
+	const int bands = (height + rows - 1) / rows;
+	const int bandSize = rows * width;
+	const int L = width * height;
+
+	std::vector<double> idleTimes;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// pool processes indices of bands of this pass as pixels [0, passBands*bandSize)
+		const int passBands = (bands + 1 - pass) / 2;
+		bool fetched = false;
+		auto fetchPass = [&](int &workFrom, int &workTo) -> bool
+		{
+			if (fetched || passBands == 0)
+				return false;
+			fetched = true;
+			workFrom = 0;
+			workTo = passBands * bandSize;
+			return true;
+		};
+		auto processPass = [&](int workFrom, int workTo)
+		{
+			for (int k = workFrom / bandSize; k < (workTo + bandSize - 1) / bandSize; k++)
+			{
+				const int band = 2 * k + pass;
+				const int blockFrom = band * bandSize;
+				const int blockTo = std::min(L, blockFrom + bandSize);
+				if (pass == 0)
+					processBlock(blockFrom, blockTo, blockFrom, blockTo);
+				else
+					processBlock(blockFrom, blockTo, blockFrom - bandSize, std::min(L, blockTo + bandSize));
+			}
+		};
+		std::vector<double> passIdleTimes = WorkStealingPool::instance().run(fetchPass, processPass, bandSize);
+		idleTimes.resize(passIdleTimes.size(), 0.0);
+		for (size_t t = 0; t < passIdleTimes.size(); t++)
+			idleTimes[t] += passIdleTimes[t];
+	}
+	return idleTimes;
+}
+
+template <int CHANNELS, bool WEIGHT_MAP>
+void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR, bool multithreaded)
 {
+	// number of channels is known at compile time (hides MeanShift::N)
+	const int N = CHANNELS;
+
 	// Declare Variables
-	int		iterationCount, i, j, k, modeCandidateX, modeCandidateY, modeCandidate_i;
-	double	mvAbs, diff, el;
+	int		i, j;
 	
 	//make sure that a lattice height and width have
 	//been defined...
@@ -3485,16 +3663,11 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 	}
 	
 	//define input data dimension with lattice
-	int lN	= N + 2;
+	const int lN	= N + 2;
 	
 	// Traverse each data point applying mean shift
 	// to each data point
 	
-	// Allcocate memory for yk
-	double	*yk		= new double [lN];
-	
-	// Allocate memory for Mh
-	double	*Mh		= new double [lN];
 
    // let's use some temporary data
    float* sdata;
@@ -3590,7 +3763,6 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
          }
       }
    }
-   double wsuml, weight;
    double hiLTr = 80.0/sigmaR;
    // done indexing/hashing
 
@@ -3607,7 +3779,23 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 #endif
 
 
-	for(i = 0; i < L; i++)
+	// applies mean shift to pixels [blockFrom, blockTo) - the block owns this part of modeTable,
+	// so a pixel can join only basins of attraction found inside of its own block or
+	// already finished ones in [joinFrom, joinTo)
+	auto processBlock = [&](int blockFrom, int blockTo, int joinFrom, int joinTo)
+	{
+	int		iterationCount, i, j, k, modeCandidateX, modeCandidateY, modeCandidate_i;
+	int		idxs, idxd, cBuck1, cBuck2, cBuck3, cBuck;
+	double	mvAbs, diff, el;
+	double	wsuml, weight, lScale;
+	double	yk[lN], Mh[lN];
+
+	// point list of this block (hides pointList and pointCount of the class)
+	std::vector<int> blockPointList(blockTo - blockFrom);
+	int		*pointList	= blockPointList.data();
+	int		pointCount;
+
+	for(i = blockFrom; i < blockTo; i++)
 	{
 		// if a mode was already assigned to this data point
 		// then skip this point, otherwise proceed to
@@ -3632,6 +3820,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 	   for(j = 0; j < lN; j++)
    		Mh[j] = 0;
    	wsuml = 0;
+   	lScale = (yk[2] > hiLTr) ? 4 : 1;
       // uniformLSearch(Mh, yk_ptr); // modify to new
       // find bucket of yk
       cBuck1 = (int) yk[0] + 1;
@@ -3654,10 +3843,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
             if (diff < 1.0)
             {
                el = sdata[idxs+2]-yk[2];
-               if (yk[2] > hiLTr)
-                  diff = 4*el*el;
-               else
-                  diff = el*el;
+               diff = lScale*el*el;
 
                if (N>1)
                {
@@ -3669,7 +3855,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 
                if (diff < 1.0)
                {
-                  weight = 1-weightMap[idxd];
+                  weight = WEIGHT_MAP ? 1-weightMap[idxd] : 1;
                   for (k=0; k<lN; k++)
                      Mh[k] += weight*sdata[idxs+k];
                   wsuml += weight;
@@ -3735,7 +3921,9 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 			//     to (modeTable[basin_i] = 1), so assign to
 			//     this data point the same mode as that of basin_i
 
-			if ((modeTable[modeCandidate_i] != 2) && (modeCandidate_i != i))
+			const bool ownedCandidate = (modeCandidate_i >= blockFrom) && (modeCandidate_i < blockTo);
+			const bool joinableCandidate = (modeCandidate_i >= joinFrom) && (modeCandidate_i < joinTo) && (modeTable[modeCandidate_i] == 1);
+			if ((ownedCandidate ? (modeTable[modeCandidate_i] != 2) : joinableCandidate) && (modeCandidate_i != i))
 			{
 				// obtain the data point at basin_i to
 				// see if it is within h*TC_DIST_FACTOR of
@@ -3801,6 +3989,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
          for(j = 0; j < lN; j++)
             Mh[j] = 0;
          wsuml = 0;
+         lScale = (yk[2] > hiLTr) ? 4 : 1;
          // uniformLSearch(Mh, yk_ptr); // modify to new
          // find bucket of yk
          cBuck1 = (int) yk[0] + 1;
@@ -3823,10 +4012,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
                if (diff < 1.0)
                {
                   el = sdata[idxs+2]-yk[2];
-                  if (yk[2] > hiLTr)
-                     diff = 4*el*el;
-                  else
-                     diff = el*el;
+                  diff = lScale*el*el;
                   
                   if (N>1)
                   {
@@ -3838,7 +4024,7 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
                   
                   if (diff < 1.0)
                   {
-                     weight = 1-weightMap[idxd];
+                     weight = WEIGHT_MAP ? 1-weightMap[idxd] : 1;
                      for (k=0; k<lN; k++)
                         Mh[k] += weight*sdata[idxs+k];
                      wsuml += weight;
@@ -3925,6 +4111,16 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 			break;		
 #endif
 	}
+	};
+
+	if (multithreaded)
+	{
+		filterStatistics.threadsIdleTime = processBasinBands(width, height, sigmaS, processBlock);
+	}
+	else
+	{
+		processBlock(0, L, 0, L);
+	}
 	
 	// Prompt user that filtering is completed
 #ifdef PROMPT
@@ -3938,8 +4134,6 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
    delete [] slist;
    delete [] sdata;
 
-	delete [] yk;
-	delete [] Mh;
 	
 	// done.
 	return;
@@ -3947,11 +4141,14 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 }
 
 // NEW
-void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
+template <int CHANNELS, bool WEIGHT_MAP>
+void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR, bool multithreaded)
 {
+	// number of channels is known at compile time (hides MeanShift::N)
+	const int N = CHANNELS;
+
 	// Declare Variables
-	int		iterationCount, i, j, k, modeCandidateX, modeCandidateY, modeCandidate_i;
-	double	mvAbs, diff, el;
+	int		i, j;
 	
 	//make sure that a lattice height and width have
 	//been defined...
@@ -3969,16 +4166,11 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 	}
 	
 	//define input data dimension with lattice
-	int lN	= N + 2;
+	const int lN	= N + 2;
 	
 	// Traverse each data point applying mean shift
 	// to each data point
 	
-	// Allcocate memory for yk
-	double	*yk		= new double [lN];
-	
-	// Allocate memory for Mh
-	double	*Mh		= new double [lN];
 
    // let's use some temporary data
    float* sdata;
@@ -4074,7 +4266,6 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
          }
       }
    }
-   double wsuml, weight;
    double hiLTr = 80.0/sigmaR;
    // done indexing/hashing
 
@@ -4091,7 +4282,23 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 #endif
 
 
-	for(i = 0; i < L; i++)
+	// applies mean shift to pixels [blockFrom, blockTo) - the block owns this part of modeTable,
+	// so a pixel can join only basins of attraction found inside of its own block or
+	// already finished ones in [joinFrom, joinTo)
+	auto processBlock = [&](int blockFrom, int blockTo, int joinFrom, int joinTo)
+	{
+	int		iterationCount, i, j, k, modeCandidateX, modeCandidateY, modeCandidate_i;
+	int		idxs, idxd, cBuck1, cBuck2, cBuck3, cBuck;
+	double	mvAbs, diff, el;
+	double	wsuml, weight, lScale;
+	double	yk[lN], Mh[lN];
+
+	// point list of this block (hides pointList and pointCount of the class)
+	std::vector<int> blockPointList(blockTo - blockFrom);
+	int		*pointList	= blockPointList.data();
+	int		pointCount;
+
+	for(i = blockFrom; i < blockTo; i++)
 	{
 		// if a mode was already assigned to this data point
 		// then skip this point, otherwise proceed to
@@ -4116,6 +4323,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 	   for(j = 0; j < lN; j++)
    		Mh[j] = 0;
    	wsuml = 0;
+   	lScale = (yk[2] > hiLTr) ? 4 : 1;
       // uniformLSearch(Mh, yk_ptr); // modify to new
       // find bucket of yk
       cBuck1 = (int) yk[0] + 1;
@@ -4138,10 +4346,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
             if (diff < 1.0)
             {
                el = sdata[idxs+2]-yk[2];
-               if (yk[2] > hiLTr)
-                  diff = 4*el*el;
-               else
-                  diff = el*el;
+               diff = lScale*el*el;
 
                if (N>1)
                {
@@ -4153,7 +4358,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 
                if (diff < 1.0)
                {
-                  weight = 1-weightMap[idxd];
+                  weight = WEIGHT_MAP ? 1-weightMap[idxd] : 1;
                   for (k=0; k<lN; k++)
                      Mh[k] += weight*sdata[idxs+k];
                   wsuml += weight;
@@ -4161,7 +4366,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
       				//set basin of attraction mode table
                   if (diff < speedThreshold)
                   {
-				         if(modeTable[idxd] == 0)
+				         if((idxd >= blockFrom) && (idxd < blockTo) && (modeTable[idxd] == 0))
 				         {
          					pointList[pointCount++]	= idxd;
 					         modeTable[idxd]	= 2;
@@ -4229,7 +4434,9 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 			//     to (modeTable[basin_i] = 1), so assign to
 			//     this data point the same mode as that of basin_i
 
-			if ((modeTable[modeCandidate_i] != 2) && (modeCandidate_i != i))
+			const bool ownedCandidate = (modeCandidate_i >= blockFrom) && (modeCandidate_i < blockTo);
+			const bool joinableCandidate = (modeCandidate_i >= joinFrom) && (modeCandidate_i < joinTo) && (modeTable[modeCandidate_i] == 1);
+			if ((ownedCandidate ? (modeTable[modeCandidate_i] != 2) : joinableCandidate) && (modeCandidate_i != i))
 			{
 				// obtain the data point at basin_i to
 				// see if it is within h*TC_DIST_FACTOR of
@@ -4295,6 +4502,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
          for(j = 0; j < lN; j++)
             Mh[j] = 0;
          wsuml = 0;
+         lScale = (yk[2] > hiLTr) ? 4 : 1;
          // uniformLSearch(Mh, yk_ptr); // modify to new
          // find bucket of yk
          cBuck1 = (int) yk[0] + 1;
@@ -4317,10 +4525,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
                if (diff < 1.0)
                {
                   el = sdata[idxs+2]-yk[2];
-                  if (yk[2] > hiLTr)
-                     diff = 4*el*el;
-                  else
-                     diff = el*el;
+                  diff = lScale*el*el;
                   
                   if (N>1)
                   {
@@ -4332,7 +4537,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
                   
                   if (diff < 1.0)
                   {
-                     weight = 1-weightMap[idxd];
+                     weight = WEIGHT_MAP ? 1-weightMap[idxd] : 1;
                      for (k=0; k<lN; k++)
                         Mh[k] += weight*sdata[idxs+k];
                      wsuml += weight;
@@ -4340,7 +4545,7 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
          				//set basin of attraction mode table
                      if (diff < speedThreshold)
                      {
-   				         if(modeTable[idxd] == 0)
+   				         if((idxd >= blockFrom) && (idxd < blockTo) && (modeTable[idxd] == 0))
 				            {
             					pointList[pointCount++]	= idxd;
 					            modeTable[idxd]	= 2;
@@ -4430,6 +4635,16 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 			break;		
 #endif
 	}
+	};
+
+	if (multithreaded)
+	{
+		filterStatistics.threadsIdleTime = processBasinBands(width, height, sigmaS, processBlock);
+	}
+	else
+	{
+		processBlock(0, L, 0, L);
+	}
 	
 	// Prompt user that filtering is completed
 #ifdef PROMPT
@@ -4443,14 +4658,29 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
    delete [] slist;
    delete [] sdata;
 
-	delete [] yk;
-	delete [] Mh;
 	
 	// done.
 	return;
 
 }
 
+// Runtime dispatch to the filters specialized for number of channels and weight map presence
+void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR, bool multithreaded)
+{
+	if (N == 3)
+		weightMapDefined ? NewOptimizedFilter1<3, true>(sigmaS, sigmaR, multithreaded) : NewOptimizedFilter1<3, false>(sigmaS, sigmaR, multithreaded);
+	else
+		weightMapDefined ? NewOptimizedFilter1<1, true>(sigmaS, sigmaR, multithreaded) : NewOptimizedFilter1<1, false>(sigmaS, sigmaR, multithreaded);
+}
+
+void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR, bool multithreaded)
+{
+	if (N == 3)
+		weightMapDefined ? NewOptimizedFilter2<3, true>(sigmaS, sigmaR, multithreaded) : NewOptimizedFilter2<3, false>(sigmaS, sigmaR, multithreaded);
+	else
+		weightMapDefined ? NewOptimizedFilter2<1, true>(sigmaS, sigmaR, multithreaded) : NewOptimizedFilter2<1, false>(sigmaS, sigmaR, multithreaded);
+}
+
 void msImageProcessor::NewNonOptimizedFilter(float sigmaS, float sigmaR)
 {
 
@@ -4812,6 +5042,64 @@ void msImageProcessor::SetSpeedThreshold(float speedUpThreshold)
    speedThreshold = speedUpThreshold;
 }
 
+const FilterStatistics& msImageProcessor::GetFilterStatistics( void ) const
+{
+   return filterStatistics;
+}
+
+void msImageProcessor::SetFilterControl(FilterControl* control)
+{
+   filterControl = control;
+}
+
+void msImageProcessor::ReportPreprocessingTime(double seconds)
+{
+   std::lock_guard<std::mutex> guard(statisticsLock);
+   if (seconds > filterStatistics.preprocessingTime)
+      filterStatistics.preprocessingTime = seconds;
+}
+
+template <typename T>
+std::shared_ptr<const MeanShiftLattice<T>> msImageProcessor::GetLattice(float sigmaS, float sigmaR, bool colorBuckets)
+{
+   std::lock_guard<std::mutex> guard(latticeCacheLock);
+   CachedLattice<T> &cache = LatticeCache((T*) nullptr);
+   if (!cache.lattice || cache.inputVersion != inputVersion
+       || cache.sigmaS != sigmaS || cache.sigmaR != sigmaR || cache.colorBuckets != colorBuckets) {
+      // the previous lattice is released before the new one is built (it can be large)
+      cache.lattice = nullptr;
+      std::shared_ptr<MeanShiftLattice<T>> lattice(new MeanShiftLattice<T>());
+      lattice->build(data, weightMap, N, width, height, sigmaS, sigmaR, colorBuckets);
+      cache.lattice = lattice;
+      cache.inputVersion = inputVersion;
+      cache.sigmaS = sigmaS;
+      cache.sigmaR = sigmaR;
+      cache.colorBuckets = colorBuckets;
+   }
+   return cache.lattice;
+}
+
+template std::shared_ptr<const MeanShiftLattice<double>> msImageProcessor::GetLattice<double>(float sigmaS, float sigmaR, bool colorBuckets);
+template std::shared_ptr<const MeanShiftLattice<float>> msImageProcessor::GetLattice<float>(float sigmaS, float sigmaR, bool colorBuckets);
+
+std::shared_ptr<const FlatRegions> msImageProcessor::GetFlatRegions(float sigmaS, float sigmaR, bool tiles)
+{
+   std::lock_guard<std::mutex> guard(latticeCacheLock);
+   CachedFlatRegions &cache = cachedFlatRegions;
+   if (!cache.flatRegions || cache.inputVersion != inputVersion || cache.sigmaS != sigmaS
+       || cache.tiles != tiles || (tiles && cache.sigmaR != sigmaR)) {
+      cache.flatRegions = nullptr;
+      std::shared_ptr<FlatRegions> flatRegions(new FlatRegions());
+      flatRegions->build(data, N, width, height, sigmaS, sigmaR, tiles);
+      cache.flatRegions = flatRegions;
+      cache.inputVersion = inputVersion;
+      cache.sigmaS = sigmaS;
+      cache.sigmaR = sigmaR;
+      cache.tiles = tiles;
+   }
+   return cache.flatRegions;
+}
+
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@ END OF CLASS DEFINITION @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
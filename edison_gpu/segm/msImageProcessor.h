@@ -51,15 +51,23 @@ Implemented by Chris M. Christoudias, Bogdan Georgescu
 #include	"RAList.h"
 
 #include	<queue>
+#include	<vector>
 #include	<mutex>
 #include	<cstddef>
 #include	<memory>
+#include	<atomic>
+#include	<chrono>
+#include	<functional>
 
 namespace cl {
 	class Device;
 	typedef std::shared_ptr<Device> Device_ptr;
 }
 
+template <typename T>
+class MeanShiftLattice;
+class FlatRegions;
+
 //define constants
 
 	//image pruning
@@ -93,6 +101,109 @@ typedef unsigned char byte;
 //define enumerations
 enum imageType {GRAYSCALE, COLOR};
 
+//timings (in seconds) and counters of the last call of msImageProcessor::Filter()
+struct FilterStatistics {
+	double	preprocessingTime;	// mean shift lattice construction (scaling, L-range scan, bucket sort),
+								// the longest one if several devices build it concurrently (AUTO_SPEEDUP)
+	double	filterTime;			// the whole mean shift filtering (including preprocessing)
+	double	connectTime;		// labeling of the filtered image regions
+	std::vector<double>	threadsIdleTime;	// idle time of each thread of CPU work stealing pool
+											// (MULTITHREADED_SPEEDUP and CPU share of AUTO_SPEEDUP)
+	long long	candidatesExamined;	// number of lattice points tested against search windows
+	long long	candidatesAccepted;	// number of them that were inside of search windows
+									// (MULTITHREADED_SPEEDUP family and CPU share of AUTO_SPEEDUP)
+	long long	iterations;			// total number of mean shift iterations of all pixels (same versions as above)
+	int			iterationsLimit;	// the lowest limit of mean shift iterations of filtered pixels
+									// (LIMIT unless the deadline of FilterControl was to be missed)
+	long long	flatPixels;			// number of pixels of flat areas written without mean shift (see ms_flat_regions.h)
+									// (MULTITHREADED_SPEEDUP family and CPU share of AUTO_SPEEDUP)
+};
+
+// Lower bound of the limit of mean shift iterations of pixels filtered after the deadline of FilterControl
+#ifndef MS_DEADLINE_MIN_ITERATIONS
+#define MS_DEADLINE_MIN_ITERATIONS 2
+#endif
+
+// Runtime control of Filter(): a wall-clock deadline and a lock-free progress counter, that can be read from any thread
+// while Filter() runs (see msImageProcessor::SetFilterControl). With a deadline each block of pixels sets the limit of
+// mean shift iterations of the remaining pixels from the rate of iterations measured since the start of Filter(), so that
+// the remaining pixels are filtered by the deadline (LIMIT while it is met, at least MS_DEADLINE_MIN_ITERATIONS once it is
+// missed), so Filter() finishes near the deadline with less converged modes instead of being aborted, and its result is still
+// used by FuseRegions() as usual.
+// Respected by the MULTITHREADED_SPEEDUP family and by the CPU share of AUTO_SPEEDUP, other versions ignore it.
+struct FilterControl {
+	bool									hasDeadline;
+	std::chrono::steady_clock::time_point	deadline;
+	std::chrono::steady_clock::time_point	started;			// start of the running Filter()
+	std::atomic<long long>					pixelsFiltered;		// progress of the running Filter() (reset by it, pixels of
+																// the downsampled image of MULTITHREADED_PYRAMID are counted too)
+	std::atomic<long long>					pixelsTotal;		// pixels the running Filter() has to filter (final value of pixelsFiltered)
+	std::atomic<long long>					iterations;			// mean shift iterations of the filtered pixels
+	std::atomic<int>						iterationsLimit;	// limit of mean shift iterations of the remaining pixels
+
+	FilterControl() : hasDeadline(false), pixelsFiltered(0), pixelsTotal(0), iterations(0), iterationsLimit(LIMIT) {}
+
+	// deadline in seconds from now
+	void SetDeadline(double seconds)
+	{
+		hasDeadline = true;
+		deadline = std::chrono::steady_clock::now()
+				 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	}
+
+	// called by Filter() before filtering of pixels
+	void Start(long long pixels)
+	{
+		started = std::chrono::steady_clock::now();
+		pixelsFiltered = 0;
+		pixelsTotal = pixels;
+		iterations = 0;
+		iterationsLimit = LIMIT;
+	}
+
+	// updates and returns the limit of iterations of the remaining pixels (see above)
+	int UpdateIterationsLimit()
+	{
+		if (!hasDeadline)
+			return iterationsLimit;
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const double elapsed = std::chrono::duration<double>(now - started).count();
+		const double timeLeft = std::chrono::duration<double>(deadline - now).count();
+		const long long filtered = pixelsFiltered, done = iterations;
+		const long long remaining = pixelsTotal - filtered;
+		int limit = LIMIT;
+		if (filtered > 0 && done > 0 && remaining > 0 && elapsed > 0) {
+			// iterations the remaining pixels can afford at the measured rate, and they need at the average of the filtered ones
+			const double budget = (timeLeft > 0 ? timeLeft : 0) * done / elapsed;
+			if (budget < (double) remaining * done / filtered) {
+				const double perPixel = budget / remaining;
+				limit = perPixel < MS_DEADLINE_MIN_ITERATIONS ? MS_DEADLINE_MIN_ITERATIONS : (perPixel < LIMIT ? (int) perPixel : LIMIT);
+			}
+		} else if (timeLeft <= 0) {
+			// nothing is measured yet
+			limit = MS_DEADLINE_MIN_ITERATIONS;
+		}
+		iterationsLimit = limit;
+		return limit;
+	}
+};
+
+//options of msImageProcessor::NewNonOptimizedFilter_omp_impl()
+//(seeds and modes are lN floats per pixel in the scaled feature space: x/sigmaS, y/sigmaS, L/sigmaR, ...)
+struct OmpFilterOptions {
+	int				tileSize;		// side of tiles in pixels (0 - pixels are processed one by one)
+	bool			colorBuckets;	// points are binned on u and v too (can not be used with tiles)
+	const float*	seeds;			// initial window centers (nullptr - each window starts at its own pixel)
+	float*			modes;			// if not nullptr - converged window centers are stored here
+	bool			binSeeds;		// windows are shifted only from centroids of occupied buckets, pixels take mode of the nearest one
+									// (can not be used with tiles, color buckets or seeds)
+	bool			flatTiles;		// pixels of almost flat tiles take the mode of the centroid of the tile (see ms_flat_regions.h)
+									// (exactly flat pixels are written without mean shift anyway unless there are seeds,
+									// bin seeds or weight map)
+
+	OmpFilterOptions() : tileSize(0), colorBuckets(false), seeds(nullptr), modes(nullptr), binSeeds(false), flatTiles(false) {}
+};
+
 //define prototype
 class msImageProcessor: public MeanShift {
 
@@ -631,6 +742,19 @@ public:
 
 
   void SetSpeedThreshold(float);
+
+  // returns timings of the last call of Filter()
+  const FilterStatistics& GetFilterStatistics( void ) const;
+
+  // deadline and progress of the next calls of Filter() (nullptr - no control), control must outlive them
+  void SetFilterControl(FilterControl* control);
+
+  // Progressive Filter() with MULTITHREADED_SPEEDUP for previews: the image downsampled by 2^(levels-1), ..., 2
+  // (with sigmaS scaled accordingly, levels with sigmaS < 1 or smaller than 2x2 are skipped) is filtered and labeled first,
+  // then the full resolution one. Windows of each level start at modes of the previous one (as in MULTITHREADED_PYRAMID_SPEEDUP).
+  // Each level is passed to onLevel with its downsampling factor (coarsest first, the last one is this processor with scale 1).
+  // Filter control is started once: its deadline and progress (pixelsTotal) cover pixels of all levels.
+  void FilterProgressive(float sigmaS, float sigmaR, int levels, const std::function<void(msImageProcessor &level, int scale)> &onLevel);
 private:
 
   //========================
@@ -650,9 +774,57 @@ private:
 	void NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
 								   float* msRawDataRes=nullptr, std::queue<std::pair<size_t, size_t>>* workQueue=nullptr, std::mutex* queueLock=nullptr, std::vector<std::pair<size_t, size_t>>* workProcessed=nullptr);
 
-	// OpenCL version of NewNonOptimizedFilter (the only difference is that calculations done in float, but not in double)
+	// Single precision version of NewNonOptimizedFilter_omp (calculations done in float as in NewNonOptimizedFilter_gpu)
+	void NewNonOptimizedFilter_omp_float(float sigmaS, float sigmaR,
+										 float* msRawDataRes=nullptr, std::queue<std::pair<size_t, size_t>>* workQueue=nullptr, std::mutex* queueLock=nullptr, std::vector<std::pair<size_t, size_t>>* workProcessed=nullptr);
+
+	// Version of NewNonOptimizedFilter_omp that processes pixels by 2D tiles: candidates of the whole tile are gathered
+	// once into a compact buffer, so neighbouring trajectories do not walk the same buckets of the lattice again
+	void NewNonOptimizedFilter_omp_tiled(float sigmaS, float sigmaR);
+
+	// Version of NewNonOptimizedFilter_omp with the lattice of 5D buckets (x, y, L, u, v) for color images:
+	// most of points that fail the u/v range test are not even loaded (order of accumulation differs from NO_SPEEDUP)
+	void NewNonOptimizedFilter_omp_5d(float sigmaS, float sigmaR);
+
+	// Coarse-to-fine version of NewNonOptimizedFilter_omp: the image downsampled 2x is filtered with sigmaS/2 first,
+	// and its modes are used as initial window centers of full resolution pixels (see MULTITHREADED_PYRAMID_SPEEDUP)
+	void NewNonOptimizedFilter_omp_pyramid(float sigmaS, float sigmaR);
+
+	// Approximate version of NewNonOptimizedFilter_omp: mean shift is applied only to centroids of occupied buckets of the lattice,
+	// each pixel takes the mode of the nearest centroid inside of its search window (see MULTITHREADED_BIN_SEEDED_SPEEDUP)
+	void NewNonOptimizedFilter_omp_binseeded(float sigmaS, float sigmaR);
+
+	// Approximate version of NewNonOptimizedFilter_omp: pixels of almost flat tiles take the mode of the centroid of the tile
+	// (see MULTITHREADED_FLAT_TILES_SPEEDUP)
+	void NewNonOptimizedFilter_omp_flat(float sigmaS, float sigmaR);
+
+	// Double precision NewNonOptimizedFilter_omp_impl with given options (whole image is processed into msRawDataRes or msRawData)
+	void NewNonOptimizedFilter_omp_options(float sigmaS, float sigmaR, float* msRawDataRes, const OmpFilterOptions &options);
+
+	template <typename real_type, int CHANNELS, bool WEIGHT_MAP>
+	void NewNonOptimizedFilter_omp_impl(float sigmaS, float sigmaR,
+										float* msRawDataRes, std::queue<std::pair<size_t, size_t>>* workQueue, std::mutex* queueLock, std::vector<std::pair<size_t, size_t>>* workProcessed,
+										const OmpFilterOptions &options = OmpFilterOptions());
+
+	// Approximate version of NewNonOptimizedFilter_omp: windows are shifted over cells of a downsampled bilateral grid
+	// (weighted sums of points of each cell) instead of points (see BILATERAL_GRID_SPEEDUP)
+	void NewNonOptimizedFilter_grid(float sigmaS, float sigmaR);
+
+	template <int CHANNELS>
+	void NewNonOptimizedFilter_grid_impl(float sigmaS, float sigmaR);
+
+	// Approximate version of NewNonOptimizedFilter_omp: points and window centers are quantized into int16 fixed point,
+	// window tests and accumulation are done with integer SIMD (see QUANTIZED_SPEEDUP)
+	void NewNonOptimizedFilter_quantized(float sigmaS, float sigmaR);
+
+	template <int CHANNELS, bool WEIGHT_MAP>
+	void NewNonOptimizedFilter_quantized_impl(float sigmaS, float sigmaR);
+
+	// OpenCL version of NewNonOptimizedFilter (the only difference is that calculations done in float, but not in double),
+	// with persistentThreads workgroups of the launch fetch pixels from a global counter (see GPU_PERSISTENT_SPEEDUP)
 	void NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
-								   float* msRawDataRes=nullptr, std::queue<std::pair<size_t, size_t>>* workQueue=nullptr, std::mutex* queueLock=nullptr, std::vector<std::pair<size_t, size_t>>* workProcessed=nullptr, cl::Device_ptr device=cl::Device_ptr());
+								   float* msRawDataRes=nullptr, std::queue<std::pair<size_t, size_t>>* workQueue=nullptr, std::mutex* queueLock=nullptr, std::vector<std::pair<size_t, size_t>>* workProcessed=nullptr, cl::Device_ptr device=cl::Device_ptr(),
+								   bool persistentThreads=false);
 
 	// Workload distributed between all GPUs (GPU_SPEEDUP) and CPU (MULTITHREADED_SPEEDUP) (results are nearly equal to NO_SPEEDUP except minor results diffs due to float/double precision)
 	void NewNonOptimizedFilter_auto(float sigmaS, float sigmaR);
@@ -664,7 +836,9 @@ private:
 											//				  version
 											// Disadvantage	: POSSIBLY not as accurate as non-optimized
 											//				  version
-   void NewOptimizedFilter1(float, float);
+   void NewOptimizedFilter1(float, float, bool multithreaded = false);
+   template <int CHANNELS, bool WEIGHT_MAP>
+   void NewOptimizedFilter1(float, float, bool multithreaded);
 
 
 	void OptimizedFilter2(float, float);	//filter the image using previous mode information
@@ -673,7 +847,9 @@ private:
 											// Advantage	: huge speed up - maintains accuracy good enough
 											//				  for segmentation
 											// Disadvantage	: not as accurate as previous filters
-   void NewOptimizedFilter2(float, float);
+   void NewOptimizedFilter2(float, float, bool multithreaded = false);
+   template <int CHANNELS, bool WEIGHT_MAP>
+   void NewOptimizedFilter2(float, float, bool multithreaded);
 
 	
 	/*/\/\/\/\/\/\/\/\/\/\/\*/
@@ -683,9 +859,10 @@ private:
 	void Connect( void );					// classifies mean shift filtered image regions using
 											// private classification structure of this class
 
-	void Fill(int, int);					// used by Connect to perform label each region in the
+	void Fill(int, int, const unsigned char*);	// used by Connect to perform label each region in the
 											// mean shift filtered image using an eight-connected
-											// fill
+											// fill (with similarity masks of pixels precomputed by
+											// CpuKernels::similarityMasks)
 
 	/*/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\/\*/
 	/* Transitive Closure and Image Pruning */
@@ -817,6 +994,61 @@ private:
 											//together, thus defining image regions
 
    float speedThreshold; // the % of window radius used in new optimized filter 2.
+
+   //##########################################
+   //#######     FILTER STATISTICS     ########
+   //##########################################
+
+	FilterStatistics	filterStatistics;	// timings of the last call of Filter()
+	FilterControl*		filterControl;		// deadline and progress of Filter() (nullptr - no control)
+	std::mutex			statisticsLock;		// preprocessing time can be reported by several devices concurrently
+
+	void ReportPreprocessingTime(double seconds);
+
+	// Filter() with non-integer sigmaS, MULTITHREADED_SPEEDUP is run with options if they are not nullptr,
+	// filter control is not restarted if startControl is false (it is already started for several calls)
+	void FilterWithOptions(float sigmaS, float sigmaR, SpeedUpLevel speedUpLevel, const OmpFilterOptions* options, bool startControl = true);
+
+   //##########################################
+   //#######    INPUT AND LATTICE CACHE  ######
+   //##########################################
+
+	// the last image given to DefineImage() and its LUV data (the same image is not converted again)
+	std::vector<byte>	definedImage;
+	std::vector<float>	definedLuv;
+	imageType			definedImageType;
+
+	// lattices are kept between calls of Filter() on the same input (e.g. when only minRegion or speedup level changes)
+	// and are rebuilt only when the input (see MeanShift::inputVersion) or the bandwidths change
+	template <typename T>
+	struct CachedLattice {
+		std::shared_ptr<const MeanShiftLattice<T>>	lattice;	// nullptr - nothing is cached
+		unsigned int	inputVersion;
+		float			sigmaS, sigmaR;
+		bool			colorBuckets;
+	};
+	CachedLattice<double>	cachedLatticeDouble;
+	CachedLattice<float>	cachedLatticeFloat;
+	std::mutex				latticeCacheLock;	// lattices can be requested by several devices concurrently (AUTO_SPEEDUP)
+
+	CachedLattice<double>& LatticeCache(double*) { return cachedLatticeDouble; }
+	CachedLattice<float>& LatticeCache(float*) { return cachedLatticeFloat; }
+
+	// returns the lattice of the current input with bandwidths sigmaS and sigmaR (the cached one if it is still valid)
+	template <typename T>
+	std::shared_ptr<const MeanShiftLattice<T>> GetLattice(float sigmaS, float sigmaR, bool colorBuckets = false);
+
+	// flat regions of the pre-pass are kept in the same way (guarded by latticeCacheLock), sigmaR matters only for tiles
+	struct CachedFlatRegions {
+		std::shared_ptr<const FlatRegions>	flatRegions;	// nullptr - nothing is cached
+		unsigned int	inputVersion;
+		float			sigmaS, sigmaR;
+		bool			tiles;
+	};
+	CachedFlatRegions	cachedFlatRegions;
+
+	// returns flat regions of the current input (the cached ones if they are still valid, see ms_flat_regions.h)
+	std::shared_ptr<const FlatRegions> GetFlatRegions(float sigmaS, float sigmaR, bool tiles);
 };
 
 #endif
\ No newline at end of file
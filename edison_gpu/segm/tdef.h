@@ -50,6 +50,36 @@ enum SpeedUpLevel	{
     GPU_SPEEDUP,           // OpenCL GPU    version of NO_SPEEDUP (results are nearly equal to NO_SPEEDUP except minor results diffs due to float/double precision)
     AUTO_SPEEDUP,          // GPU + CPU     version of NO_SPEEDUP (results are nearly equal to NO_SPEEDUP except minor results diffs due to float/double precision)
                            // workload distributed between all GPUs (using GPU_SPEEDUP) and CPU (using MULTITHREADED_SPEEDUP)
+    MULTITHREADED_FLOAT_SPEEDUP, // MULTITHREADED_SPEEDUP in float (results are nearly equal to NO_SPEEDUP as with GPU_SPEEDUP)
+                                 // use validateFilter() from mean_shift.h to measure the difference with the double precision version
+    MED_MULTITHREADED_SPEEDUP,   // Multithreaded version of MED_SPEEDUP  (results do not depend on number of threads)
+    HIGH_MULTITHREADED_SPEEDUP,  // Multithreaded version of HIGH_SPEEDUP (results do not depend on number of threads)
+                                 // results are slightly different from MED_SPEEDUP/HIGH_SPEEDUP, because pixels can join
+                                 // only basins of attraction found in their own band of rows (at least 8*sigmaS rows high)
+                                 // or in finished neighbouring bands (e.g. ~1% more regions before fusion on 2048x256, sigmaS=8)
+    MULTITHREADED_TILED_SPEEDUP, // MULTITHREADED_SPEEDUP that processes pixels by 2D tiles with candidates gathered once per tile
+                                 // (results are strictly equal, less memory traffic with large sigmaS)
+    MULTITHREADED_5D_SPEEDUP,    // MULTITHREADED_SPEEDUP with lattice buckets binned on u and v too (for saturated color images
+                                 // with large sigmaS only: with sigmaS=8 it is slower than MULTITHREADED_SPEEDUP on unicorn_512)
+                                 // (results are nearly equal to NO_SPEEDUP - candidates are accumulated in different order)
+    MULTITHREADED_PYRAMID_SPEEDUP, // MULTITHREADED_SPEEDUP with windows started at modes of the image downsampled 2x
+                                   // (fewer iterations, but results are approximate: a pixel can converge to a neighbouring
+                                   // mode of the same basin, use validateFilter() from mean_shift.h to measure the difference)
+    BILATERAL_GRID_SPEEDUP,      // Multithreaded approximation of NO_SPEEDUP for previews: search windows are tested against
+                                 // centroids of cells of a bilateral grid (cells of sigmaS x sigmaS x sigmaR^3) instead of points
+                                 // (much faster, but results are approximate, use validateFilter() to measure the difference)
+    MULTITHREADED_BIN_SEEDED_SPEEDUP, // MULTITHREADED_SPEEDUP with windows shifted only from centroids of occupied lattice buckets,
+                                      // each pixel takes the mode of the nearest centroid inside of its own search window
+                                      // (results are approximate, use validateFilter() to measure the difference)
+    QUANTIZED_SPEEDUP,           // Multithreaded approximation of NO_SPEEDUP: points are stored in int16 fixed point (1/16 pixel,
+                                 // 1/64 of LUV unit at most), window tests and accumulation are done with integer SIMD
+                                 // (results are approximate, use validateFilter() to measure the difference)
+    MULTITHREADED_FLAT_TILES_SPEEDUP, // MULTITHREADED_SPEEDUP with pixels of almost flat tiles (colors of the tile and around it deviate
+                                      // by less than sigmaR/5 on average and sigmaR/2 at most) taking the mode of the centroid of the tile,
+                                      // found once per tile
+                                      // (results are approximate, use validateFilter() to measure the difference)
+    GPU_PERSISTENT_SPEEDUP,      // GPU_SPEEDUP with only as many workgroups as the device runs at once, each of them fetches the next
+                                 // pixel from a global atomic counter when the previous one converged (results are equal to GPU_SPEEDUP)
 };
 
 // Error Handler
@@ -4,6 +4,8 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 void SegmentedRegions::init(size_t width, size_t height, const RegionList &regionList, const int* labels)
 {
@@ -52,12 +54,8 @@ int SegmentedRegions::getPixelLabelsNumber()
     return nlabels;
 }
 
-SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int height, int nChannels,
-                                       float sigmaS, float sigmaR, int minRegion, SpeedUpLevel implementation,
-                                       bool verbose)
+static void defineImage(msImageProcessor &processor, const unsigned char *data, int width, int height, int nChannels)
 {
-    msImageProcessor processor;
-
     if (nChannels == 3) {
         processor.DefineImage(data, COLOR, height, width);
     } else if (nChannels == 1) {
@@ -65,6 +63,15 @@ SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int
     } else {
         throw std::runtime_error("Only grayscale and 3-channels images are supported!");
     }
+}
+
+SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int height, int nChannels,
+                                       float sigmaS, float sigmaR, int minRegion, SpeedUpLevel implementation,
+                                       bool verbose, FilterControl *control)
+{
+    msImageProcessor processor;
+    defineImage(processor, data, width, height, nChannels);
+    processor.SetFilterControl(control);
 
     performance_timer timer_filter;
     processor.Filter(sigmaS, sigmaR, implementation);
@@ -73,6 +80,25 @@ SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int
     }
     if (verbose) {
         std::cout << "Filter completed in\t\t\t" << timer_filter.elapsed() << " s" << std::endl;
+        std::cout << "  including lattice preprocessing\t" << processor.GetFilterStatistics().preprocessingTime << " s" << std::endl;
+        const std::vector<double> &idleTimes = processor.GetFilterStatistics().threadsIdleTime;
+        for (size_t i = 0; i < idleTimes.size(); ++i) {
+            std::cout << "  CPU thread #" << i << " idle\t\t" << idleTimes[i] << " s" << std::endl;
+        }
+        const FilterStatistics &statistics = processor.GetFilterStatistics();
+        if (statistics.candidatesExamined > 0) {
+            std::cout << "  candidates examined/accepted\t" << statistics.candidatesExamined << "/" << statistics.candidatesAccepted
+                      << " (" << 100.0 * statistics.candidatesAccepted / statistics.candidatesExamined << "%)" << std::endl;
+        }
+        if (statistics.iterations > 0) {
+            std::cout << "  mean shift iterations per pixel\t" << (double) statistics.iterations / ((size_t) width * height) << std::endl;
+        }
+        if (statistics.flatPixels > 0) {
+            std::cout << "  flat pixels written directly\t" << statistics.flatPixels << " (" << 100.0 * statistics.flatPixels / ((size_t) width * height) << "%)" << std::endl;
+        }
+        if (statistics.iterationsLimit < LIMIT) {
+            std::cout << "  iterations limited by deadline to\t" << statistics.iterationsLimit << std::endl;
+        }
     }
 
     performance_timer fusion_timer;
@@ -88,3 +114,111 @@ SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int
     regions.init(width, height, *processor.GetBoundaries(), (const int *) processor.labels);
     return regions;
 }
+
+SegmentedRegions meanShiftSegmentationProgressive(const unsigned char *data, int width, int height, int nChannels,
+                                                  float sigmaS, float sigmaR, int minRegion, int levels,
+                                                  const SegmentationLevelCallback &onLevel, bool verbose)
+{
+    msImageProcessor processor;
+    defineImage(processor, data, width, height, nChannels);
+
+    SegmentedRegions regions;
+    performance_timer timer;
+    processor.FilterProgressive(sigmaS, sigmaR, levels, [&](msImageProcessor &level, int scale) {
+        // minimal region area is scaled with the image
+        level.FuseRegions(sigmaR, std::max(minRegion / (scale * scale), 1));
+        if (level.ErrorStatus) {
+            throw std::runtime_error("Regions fusion failed!");
+        }
+        regions.init((width + scale - 1) / scale, (height + scale - 1) / scale, *level.GetBoundaries(), (const int *) level.labels);
+        if (verbose) {
+            std::cout << "Level 1/" << scale << " segmented in		" << timer.elapsed() << " s ("
+                      << regions.getNumRegions() << " regions)" << std::endl;
+        }
+        onLevel(regions, scale);
+    });
+    if (processor.ErrorStatus) {
+        throw std::runtime_error("Filtering failed!");
+    }
+    return regions;
+}
+
+// Filters image (and fuses regions if minRegion > 0), returns filtered data and pixels labels
+static void filterAndLabel(const unsigned char *data, int width, int height, int nChannels,
+                           float sigmaS, float sigmaR, int minRegion, SpeedUpLevel implementation, bool verbose,
+                           std::vector<float> &rawData, std::vector<int> &labels)
+{
+    msImageProcessor processor;
+    defineImage(processor, data, width, height, nChannels);
+
+    performance_timer timer_filter;
+    processor.Filter(sigmaS, sigmaR, implementation);
+    if (processor.ErrorStatus) {
+        throw std::runtime_error("Filtering failed!");
+    }
+    if (verbose) {
+        std::cout << "Filter (speedup level " << implementation << ") completed in\t" << timer_filter.elapsed() << " s" << std::endl;
+        if (processor.GetFilterStatistics().iterations > 0) {
+            std::cout << "  mean shift iterations per pixel\t" << (double) processor.GetFilterStatistics().iterations / ((size_t) width * height) << std::endl;
+        }
+    }
+
+    rawData.resize((size_t) width * height * nChannels);
+    processor.GetRawData(rawData.data());
+
+    if (minRegion > 0) {
+        processor.FuseRegions(sigmaR, minRegion);
+        if (processor.ErrorStatus) {
+            throw std::runtime_error("Regions fusion failed!");
+        }
+    }
+
+    labels.assign(processor.labels, processor.labels + (size_t) width * height);
+}
+
+FilterValidationReport validateFilter(const unsigned char *data, int width, int height, int nChannels,
+                                      float sigmaS, float sigmaR, int minRegion,
+                                      SpeedUpLevel implementation, SpeedUpLevel reference,
+                                      bool verbose)
+{
+    std::vector<float> rawData, referenceRawData;
+    std::vector<int> labels, referenceLabels;
+    filterAndLabel(data, width, height, nChannels, sigmaS, sigmaR, minRegion, implementation, verbose, rawData, labels);
+    filterAndLabel(data, width, height, nChannels, sigmaS, sigmaR, minRegion, reference, verbose, referenceRawData, referenceLabels);
+
+    FilterValidationReport report;
+    report.maxDeviation = 0.0f;
+    for (size_t i = 0; i < rawData.size(); ++i) {
+        report.maxDeviation = std::max(report.maxDeviation, std::abs(rawData[i] - referenceRawData[i]));
+    }
+
+    // labels are arbitrary numbers, so segmentations are compared by pixels connectivity:
+    // pixel disagrees if it is in the same region with its right or bottom neighbour only in one of segmentations
+    size_t disagreements = 0;
+    for (ptrdiff_t j = 0; j < height; ++j) {
+        for (ptrdiff_t i = 0; i < width; ++i) {
+            ptrdiff_t index = j * width + i;
+            bool disagree = false;
+            if (i + 1 < width) {
+                disagree |= (labels[index] == labels[index + 1]) != (referenceLabels[index] == referenceLabels[index + 1]);
+            }
+            if (j + 1 < height) {
+                disagree |= (labels[index] == labels[index + width]) != (referenceLabels[index] == referenceLabels[index + width]);
+            }
+            if (disagree) {
+                ++disagreements;
+            }
+        }
+    }
+    report.labelsDisagreementRate = (double) disagreements / ((size_t) width * height);
+
+    report.regionsNumber = *std::max_element(labels.begin(), labels.end()) + 1;
+    report.referenceRegionsNumber = *std::max_element(referenceLabels.begin(), referenceLabels.end()) + 1;
+
+    if (verbose) {
+        std::cout << "Max filtered data deviation:\t\t" << report.maxDeviation << std::endl;
+        std::cout << "Labels disagreement rate:\t\t" << report.labelsDisagreementRate * 100.0 << "%" << std::endl;
+        std::cout << "Regions number:\t\t\t\t" << report.regionsNumber << " (reference: " << report.referenceRegionsNumber << ")" << std::endl;
+    }
+    return report;
+}
@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <cstddef>
+#include <functional>
 
 struct PixelPosition {
     int row;
@@ -11,6 +12,7 @@ struct PixelPosition {
 };
 
 class RegionList;
+struct FilterControl;
 
 class SegmentedRegions {
 public:
@@ -37,5 +39,34 @@ private:
 SegmentedRegions meanShiftSegmentation(const unsigned char *data, int width, int height, int nChannels,
                                        float sigmaS, float sigmaR, int minRegion,
                                        SpeedUpLevel implementation = HIGH_SPEEDUP,
-                                       bool verbose = false
+                                       bool verbose = false,
+                                       FilterControl *control = nullptr    // deadline and progress of filtering (see msImageProcessor.h)
+);
+
+// Called with segmentation of the image downsampled by scale (scale is 1 for the final full resolution segmentation)
+typedef std::function<void(SegmentedRegions &regions, int scale)> SegmentationLevelCallback;
+
+// Progressive segmentation for previews (MULTITHREADED_SPEEDUP): the image downsampled up to 2^(levels-1) times
+// is segmented first, each next level (2x larger) starts its mean shift windows at modes of the previous one,
+// so all levels together take about as long as a single full resolution filtering.
+// onLevel is called for each level (coarsest first), full resolution segmentation is also returned.
+SegmentedRegions meanShiftSegmentationProgressive(const unsigned char *data, int width, int height, int nChannels,
+                                                  float sigmaS, float sigmaR, int minRegion, int levels,
+                                                  const SegmentationLevelCallback &onLevel,
+                                                  bool verbose = false
+);
+
+struct FilterValidationReport {
+    float  maxDeviation;            // maximum absolute difference of filtered LUV values (msRawData)
+    double labelsDisagreementRate;  // fraction of pixels whose 'same region' relation with right or bottom neighbour differs
+    int    regionsNumber;           // number of regions in segmentation with validated implementation
+    int    referenceRegionsNumber;  // number of regions in segmentation with reference implementation
+};
+
+// Runs the filter (and regions fusion if minRegion > 0) with both implementations on the same image and compares results
+FilterValidationReport validateFilter(const unsigned char *data, int width, int height, int nChannels,
+                                      float sigmaS, float sigmaR, int minRegion,
+                                      SpeedUpLevel implementation = MULTITHREADED_FLOAT_SPEEDUP,
+                                      SpeedUpLevel reference = MULTITHREADED_SPEEDUP,
+                                      bool verbose = false
 );
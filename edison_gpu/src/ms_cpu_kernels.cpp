@@ -0,0 +1,119 @@
+#include "ms_cpu_kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(MS_CPU_KERNELS_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace {
+
+#if defined(MS_CPU_KERNELS_X86)
+void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, (int) leaf, (int) subleaf);
+    for (int k = 0; k < 4; k++)
+        regs[k] = (unsigned int) r[k];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// state components enabled by OS (XCR0)
+unsigned long long xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long) edx << 32) | eax;
+#endif
+}
+#endif
+
+// the widest instruction set that is supported both by CPU and by OS (AVX registers have to be saved on context switches)
+CpuIsa detectCpuIsa()
+{
+#if defined(MS_CPU_KERNELS_X86)
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    const unsigned int maxLeaf = regs[0];
+
+    cpuid(1, 0, regs);
+    const bool sse2 = (regs[3] >> 26) & 1;
+    const bool osxsave = (regs[2] >> 27) & 1;
+    if (!sse2)
+        return CPU_ISA_SCALAR;
+    if (!osxsave || maxLeaf < 7)
+        return CPU_ISA_SSE2;
+
+    const unsigned long long xcr0 = xgetbv0();
+    const bool osAvx = (xcr0 & 0x6) == 0x6;         // SSE and AVX state
+    const bool osAvx512 = (xcr0 & 0xe6) == 0xe6;    // and opmask, upper ZMM halves and ZMM16-31 state
+
+    cpuid(7, 0, regs);
+    const bool avx2 = (regs[1] >> 5) & 1;
+    const bool avx512 = ((regs[1] >> 16) & 1) && ((regs[1] >> 17) & 1)     // F, DQ
+                     && ((regs[1] >> 30) & 1) && ((regs[1] >> 31) & 1);    // BW, VL
+
+    if (osAvx512 && avx512 && avx2)
+        return CPU_ISA_AVX512;
+    if (osAvx && avx2)
+        return CPU_ISA_AVX2;
+    return CPU_ISA_SSE2;
+#else
+    return CPU_ISA_SCALAR;
+#endif
+}
+
+const CpuKernels* compiledCpuKernels(CpuIsa isa)
+{
+    switch (isa) {
+    case CPU_ISA_AVX512: return avx512CpuKernels();
+    case CPU_ISA_AVX2:   return avx2CpuKernels();
+    case CPU_ISA_SSE2:   return sse2CpuKernels();
+    default:             return scalarCpuKernels();
+    }
+}
+
+const CpuKernels* selectCpuKernels()
+{
+    // the widest supported variant that is compiled in
+    const CpuIsa detected = detectCpuIsa();
+    const CpuKernels* best = nullptr;
+    for (int isa = detected; isa >= CPU_ISA_SCALAR && best == nullptr; isa--)
+        best = compiledCpuKernels((CpuIsa) isa);
+
+    const char* requested = std::getenv("EDISON_GPU_CPU_ISA");
+    if (requested == nullptr || *requested == 0)
+        return best;
+    for (int isa = CPU_ISA_SCALAR; isa <= CPU_ISA_AVX512; isa++) {
+        const CpuKernels* kernels = cpuKernels((CpuIsa) isa);
+        if (kernels != nullptr && std::strcmp(kernels->name, requested) == 0)
+            return kernels;
+    }
+    std::cerr << "EDISON_GPU_CPU_ISA=" << requested << " is not supported, " << best->name << " kernels are used" << std::endl;
+    return best;
+}
+
+}
+
+const CpuKernels* cpuKernels(CpuIsa isa)
+{
+    return isa <= detectCpuIsa() ? compiledCpuKernels(isa) : nullptr;
+}
+
+const CpuKernels& cpuKernels()
+{
+    static const CpuKernels* selected = selectCpuKernels();
+    return *selected;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MS_CPU_KERNELS_X86
+#endif
+
+// numbers of candidates tested against search windows and accepted (i.e. inside of them),
+// and number of mean shift iterations
+struct FilterCounters {
+    long long examined;
+    long long accepted;
+    long long iterations;
+};
+
+// points of the quantized lattice in int16 fixed point (see QUANTIZED_SPEEDUP)
+struct QuantizedPoints {
+    const int16_t* sdims[5];    // k-th dimension of point p is sdims[k][p]
+    const int16_t* weights;     // kernel weights in fixed point (if weight map is defined)
+};
+
+// search window of the quantized filter with its center rounded to fixed point units
+struct QuantizedWindow {
+    int yk[5];
+    int spatialLimit;   // squared spatial radius in fixed point units (exclusive)
+    int rangeLimit;     // squared range radius in fixed point units (exclusive)
+    int lShift;         // 1 if the L difference is doubled (lScale = 4), 0 otherwise
+};
+
+// sums of accepted points (in fixed point units) and of their weights
+struct QuantizedSums {
+    long long s[5];
+    long long w;
+    long long examined;
+    long long accepted;
+};
+
+enum CpuIsa {
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE2,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512,     // AVX-512 F, BW, DQ and VL
+};
+
+// Hot loops of the CPU filters and of the connected components labeling, compiled for several instruction sets
+// (see ms_cpu_kernels_impl.h). Function pointers are indexed by [lN == 5][WEIGHT_MAP].
+struct CpuKernels {
+    CpuIsa      isa;
+    const char* name;
+
+    // adds to the mean shift vector Mh all sorted lattice points [from, to) that are inside of the search window centered at yk
+    // (in the same order as NO_SPEEDUP does, so results are bit-equal with any instruction set)
+    void (*evaluateCandidates[2][2])(const double* const* sdims, const float* weights, int from, int to,
+                                     const double* yk, double lScale, double* Mh, double &wsuml, FilterCounters &counters);
+    void (*evaluateCandidatesFloat[2][2])(const float* const* sdims, const float* weights, int from, int to,
+                                          const float* yk, float lScale, float* Mh, float &wsuml, FilterCounters &counters);
+
+    // adds to the sums all quantized points [from, to) that are inside of the window (integer arithmetic only)
+    void (*evaluateQuantizedCandidates[2][2])(const QuantizedPoints &points, int from, int to,
+                                              const QuantizedWindow &window, QuantizedSums &sums);
+
+    // converts n RGB pixels to LUV (as msImageProcessor::RGBtoLUV does)
+    void (*rgbToLuv)(const unsigned char* rgb, float* luv, int n);
+
+    // bit d of masks[p] is set if colors of pixels p and p + {1, width-1, width, width+1}[d] differ by less than threshold
+    // in each channel (pixels are compared the same way as msImageProcessor::Fill does)
+    void (*similarityMasks)(const float* luv, int N, int L, int width, float threshold, unsigned char* masks);
+};
+
+// Kernels selected once: of the widest instruction set supported by the CPU (cpuid),
+// or of the one given by EDISON_GPU_CPU_ISA environment variable (scalar, sse2, avx2 or avx512) if it is supported.
+const CpuKernels& cpuKernels();
+
+// Kernels of the given instruction set, or nullptr if they are not compiled in or are not supported by the CPU
+const CpuKernels* cpuKernels(CpuIsa isa);
+
+// variants compiled with different instruction sets (nullptr if the compiler does not support the instruction set)
+const CpuKernels* scalarCpuKernels();
+const CpuKernels* sse2CpuKernels();
+const CpuKernels* avx2CpuKernels();
+const CpuKernels* avx512CpuKernels();
@@ -0,0 +1,8 @@
+// AVX2 variant of CPU kernels (compiled with AVX2 enabled, see CMakeLists.txt)
+#include "ms_cpu_kernels_impl.h"
+
+// nullptr if the compiler did not enable the instruction set for this file (e.g. on CPUs other than x86)
+const CpuKernels* avx2CpuKernels()
+{
+    return implKernels.isa == CPU_ISA_AVX2 ? &implKernels : nullptr;
+}
@@ -0,0 +1,8 @@
+// AVX-512 variant of CPU kernels (compiled with AVX-512 F/BW/DQ/VL enabled, see CMakeLists.txt)
+#include "ms_cpu_kernels_impl.h"
+
+// nullptr if the compiler did not enable the instruction set for this file (e.g. on CPUs other than x86)
+const CpuKernels* avx512CpuKernels()
+{
+    return implKernels.isa == CPU_ISA_AVX512 ? &implKernels : nullptr;
+}
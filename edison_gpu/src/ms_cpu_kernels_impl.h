@@ -0,0 +1,714 @@
+// Implementation of CpuKernels (see ms_cpu_kernels.h) for the instruction set the translation unit is compiled with.
+// It is included by ms_cpu_kernels_<isa>.cpp only - each of them is compiled with its own flags (see CMakeLists.txt),
+// so everything here is in the anonymous namespace of the including translation unit.
+#pragma once
+
+#include "../segm/msImageProcessor.h"
+#include "ms_cpu_kernels.h"
+
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if !defined(MS_CPU_KERNELS_NO_SIMD)
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512DQ__) && defined(__AVX512VL__)
+#include <immintrin.h>
+#define MS_KERNELS_AVX512
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define MS_KERNELS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MS_KERNELS_SSE2
+#endif
+#endif
+
+// number of SIMD iterations after which 32-bit accumulators of the quantized filter are flushed into 64-bit sums
+// (each lane gets at most two products of int16 values and weights in 1/128 per iteration, so 64 iterations fit into int32)
+#define MS_QUANTIZED_FLUSH_PERIOD 64
+
+namespace {
+
+#if defined(MS_KERNELS_AVX512)
+const CpuIsa kernelsIsa = CPU_ISA_AVX512;
+const char* const kernelsName = "avx512";
+#elif defined(MS_KERNELS_AVX2)
+const CpuIsa kernelsIsa = CPU_ISA_AVX2;
+const char* const kernelsName = "avx2";
+#elif defined(MS_KERNELS_SSE2)
+const CpuIsa kernelsIsa = CPU_ISA_SSE2;
+const char* const kernelsName = "sse2";
+#else
+const CpuIsa kernelsIsa = CPU_ISA_SCALAR;
+const char* const kernelsName = "scalar";
+#endif
+
+inline int bitsCount(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    return (int) __popcnt(mask);
+#else
+    return __builtin_popcount(mask);
+#endif
+}
+
+inline int lowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Adds to the mean shift vector Mh candidates i+k for all set bits k of the mask (in ascending order)
+template <int lN, bool WEIGHT_MAP, typename real_type>
+inline void accumulateCandidates(const real_type* const* sdims, const float* weights,
+                                 const int i, unsigned int mask, real_type* Mh, real_type &wsuml)
+{
+    while (mask) {
+        const int idxd = i + lowestBit(mask);
+        real_type weight = WEIGHT_MAP ? weights[idxd] : 1;
+        for (int k = 0; k < lN; k++)
+            Mh[k] += weight*sdims[k][idxd];
+        wsuml += weight;
+        mask &= mask - 1;
+    }
+}
+
+// SIMD part of evaluateCandidates for double precision: returns index of the first candidate that was not processed
+template <int lN, bool WEIGHT_MAP>
+inline int evaluateCandidatesSIMD(const double* const* sdims, const float* weights,
+                                  const int from, const int to,
+                                  const double* yk, const double lScale,
+                                  double* Mh, double &wsuml, FilterCounters &counters)
+{
+    int i = from;
+
+#if defined(MS_KERNELS_AVX512)
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d lScales = _mm512_set1_pd(lScale);
+    for (; i + 8 <= to; i += 8) {
+        // determine if inside spatial search window
+        __m512d el = _mm512_sub_pd(_mm512_loadu_pd(sdims[0] + i), _mm512_set1_pd(yk[0]));
+        __m512d diff = _mm512_mul_pd(el, el);
+        el = _mm512_sub_pd(_mm512_loadu_pd(sdims[1] + i), _mm512_set1_pd(yk[1]));
+        diff = _mm512_add_pd(diff, _mm512_mul_pd(el, el));
+
+        unsigned int mask = _mm512_cmp_pd_mask(diff, one, _CMP_LT_OQ);
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm512_sub_pd(_mm512_loadu_pd(sdims[2] + i), _mm512_set1_pd(yk[2]));
+        diff = _mm512_mul_pd(_mm512_mul_pd(lScales, el), el);
+        if (lN > 3) {
+            el = _mm512_sub_pd(_mm512_loadu_pd(sdims[3] + i), _mm512_set1_pd(yk[3]));
+            diff = _mm512_add_pd(diff, _mm512_mul_pd(el, el));
+            el = _mm512_sub_pd(_mm512_loadu_pd(sdims[4] + i), _mm512_set1_pd(yk[4]));
+            diff = _mm512_add_pd(diff, _mm512_mul_pd(el, el));
+        }
+        mask &= _mm512_cmp_pd_mask(diff, one, _CMP_LT_OQ);
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#elif defined(MS_KERNELS_AVX2)
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d lScales = _mm256_set1_pd(lScale);
+    for (; i + 4 <= to; i += 4) {
+        // determine if inside spatial search window
+        __m256d el = _mm256_sub_pd(_mm256_loadu_pd(sdims[0] + i), _mm256_set1_pd(yk[0]));
+        __m256d diff = _mm256_mul_pd(el, el);
+        el = _mm256_sub_pd(_mm256_loadu_pd(sdims[1] + i), _mm256_set1_pd(yk[1]));
+        diff = _mm256_add_pd(diff, _mm256_mul_pd(el, el));
+
+        unsigned int mask = _mm256_movemask_pd(_mm256_cmp_pd(diff, one, _CMP_LT_OQ));
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm256_sub_pd(_mm256_loadu_pd(sdims[2] + i), _mm256_set1_pd(yk[2]));
+        diff = _mm256_mul_pd(_mm256_mul_pd(lScales, el), el);
+        if (lN > 3) {
+            el = _mm256_sub_pd(_mm256_loadu_pd(sdims[3] + i), _mm256_set1_pd(yk[3]));
+            diff = _mm256_add_pd(diff, _mm256_mul_pd(el, el));
+            el = _mm256_sub_pd(_mm256_loadu_pd(sdims[4] + i), _mm256_set1_pd(yk[4]));
+            diff = _mm256_add_pd(diff, _mm256_mul_pd(el, el));
+        }
+        mask &= _mm256_movemask_pd(_mm256_cmp_pd(diff, one, _CMP_LT_OQ));
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#elif defined(MS_KERNELS_SSE2)
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d lScales = _mm_set1_pd(lScale);
+    for (; i + 2 <= to; i += 2) {
+        // determine if inside spatial search window
+        __m128d el = _mm_sub_pd(_mm_loadu_pd(sdims[0] + i), _mm_set1_pd(yk[0]));
+        __m128d diff = _mm_mul_pd(el, el);
+        el = _mm_sub_pd(_mm_loadu_pd(sdims[1] + i), _mm_set1_pd(yk[1]));
+        diff = _mm_add_pd(diff, _mm_mul_pd(el, el));
+
+        unsigned int mask = _mm_movemask_pd(_mm_cmplt_pd(diff, one));
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm_sub_pd(_mm_loadu_pd(sdims[2] + i), _mm_set1_pd(yk[2]));
+        diff = _mm_mul_pd(_mm_mul_pd(lScales, el), el);
+        if (lN > 3) {
+            el = _mm_sub_pd(_mm_loadu_pd(sdims[3] + i), _mm_set1_pd(yk[3]));
+            diff = _mm_add_pd(diff, _mm_mul_pd(el, el));
+            el = _mm_sub_pd(_mm_loadu_pd(sdims[4] + i), _mm_set1_pd(yk[4]));
+            diff = _mm_add_pd(diff, _mm_mul_pd(el, el));
+        }
+        mask &= _mm_movemask_pd(_mm_cmplt_pd(diff, one));
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#endif
+
+    return i;
+}
+
+// SIMD part of evaluateCandidates for single precision (twice wider than double precision one)
+template <int lN, bool WEIGHT_MAP>
+inline int evaluateCandidatesSIMD(const float* const* sdims, const float* weights,
+                                  const int from, const int to,
+                                  const float* yk, const float lScale,
+                                  float* Mh, float &wsuml, FilterCounters &counters)
+{
+    int i = from;
+
+#if defined(MS_KERNELS_AVX512)
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 lScales = _mm512_set1_ps(lScale);
+    for (; i + 16 <= to; i += 16) {
+        // determine if inside spatial search window
+        __m512 el = _mm512_sub_ps(_mm512_loadu_ps(sdims[0] + i), _mm512_set1_ps(yk[0]));
+        __m512 diff = _mm512_mul_ps(el, el);
+        el = _mm512_sub_ps(_mm512_loadu_ps(sdims[1] + i), _mm512_set1_ps(yk[1]));
+        diff = _mm512_add_ps(diff, _mm512_mul_ps(el, el));
+
+        unsigned int mask = _mm512_cmp_ps_mask(diff, one, _CMP_LT_OQ);
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm512_sub_ps(_mm512_loadu_ps(sdims[2] + i), _mm512_set1_ps(yk[2]));
+        diff = _mm512_mul_ps(_mm512_mul_ps(lScales, el), el);
+        if (lN > 3) {
+            el = _mm512_sub_ps(_mm512_loadu_ps(sdims[3] + i), _mm512_set1_ps(yk[3]));
+            diff = _mm512_add_ps(diff, _mm512_mul_ps(el, el));
+            el = _mm512_sub_ps(_mm512_loadu_ps(sdims[4] + i), _mm512_set1_ps(yk[4]));
+            diff = _mm512_add_ps(diff, _mm512_mul_ps(el, el));
+        }
+        mask &= _mm512_cmp_ps_mask(diff, one, _CMP_LT_OQ);
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#elif defined(MS_KERNELS_AVX2)
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 lScales = _mm256_set1_ps(lScale);
+    for (; i + 8 <= to; i += 8) {
+        // determine if inside spatial search window
+        __m256 el = _mm256_sub_ps(_mm256_loadu_ps(sdims[0] + i), _mm256_set1_ps(yk[0]));
+        __m256 diff = _mm256_mul_ps(el, el);
+        el = _mm256_sub_ps(_mm256_loadu_ps(sdims[1] + i), _mm256_set1_ps(yk[1]));
+        diff = _mm256_add_ps(diff, _mm256_mul_ps(el, el));
+
+        unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(diff, one, _CMP_LT_OQ));
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm256_sub_ps(_mm256_loadu_ps(sdims[2] + i), _mm256_set1_ps(yk[2]));
+        diff = _mm256_mul_ps(_mm256_mul_ps(lScales, el), el);
+        if (lN > 3) {
+            el = _mm256_sub_ps(_mm256_loadu_ps(sdims[3] + i), _mm256_set1_ps(yk[3]));
+            diff = _mm256_add_ps(diff, _mm256_mul_ps(el, el));
+            el = _mm256_sub_ps(_mm256_loadu_ps(sdims[4] + i), _mm256_set1_ps(yk[4]));
+            diff = _mm256_add_ps(diff, _mm256_mul_ps(el, el));
+        }
+        mask &= _mm256_movemask_ps(_mm256_cmp_ps(diff, one, _CMP_LT_OQ));
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#elif defined(MS_KERNELS_SSE2)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 lScales = _mm_set1_ps(lScale);
+    for (; i + 4 <= to; i += 4) {
+        // determine if inside spatial search window
+        __m128 el = _mm_sub_ps(_mm_loadu_ps(sdims[0] + i), _mm_set1_ps(yk[0]));
+        __m128 diff = _mm_mul_ps(el, el);
+        el = _mm_sub_ps(_mm_loadu_ps(sdims[1] + i), _mm_set1_ps(yk[1]));
+        diff = _mm_add_ps(diff, _mm_mul_ps(el, el));
+
+        unsigned int mask = _mm_movemask_ps(_mm_cmplt_ps(diff, one));
+        if (mask == 0)
+            continue;
+
+        // determine if inside range search window
+        el = _mm_sub_ps(_mm_loadu_ps(sdims[2] + i), _mm_set1_ps(yk[2]));
+        diff = _mm_mul_ps(_mm_mul_ps(lScales, el), el);
+        if (lN > 3) {
+            el = _mm_sub_ps(_mm_loadu_ps(sdims[3] + i), _mm_set1_ps(yk[3]));
+            diff = _mm_add_ps(diff, _mm_mul_ps(el, el));
+            el = _mm_sub_ps(_mm_loadu_ps(sdims[4] + i), _mm_set1_ps(yk[4]));
+            diff = _mm_add_ps(diff, _mm_mul_ps(el, el));
+        }
+        mask &= _mm_movemask_ps(_mm_cmplt_ps(diff, one));
+
+        counters.accepted += bitsCount(mask);
+        accumulateCandidates<lN, WEIGHT_MAP>(sdims, weights, i, mask, Mh, wsuml);
+    }
+#endif
+
+    return i;
+}
+
+// Adds to the mean shift vector Mh all sorted lattice points [from, to) that are inside of the search window centered at yk.
+// sdims[k] is the contiguous array of k-th dimension of scaled data (x, y, L, u, v), weights are kernel weights of points.
+// Candidates are accumulated strictly in the given order, so results are bit-equal to the scalar NO_SPEEDUP version.
+template <typename real_type, int lN, bool WEIGHT_MAP>
+void evaluateCandidates(const real_type* const* sdims, const float* weights,
+                        const int from, const int to,
+                        const real_type* yk, const real_type lScale,
+                        real_type* Mh, real_type &wsuml, FilterCounters &counters)
+{
+    counters.examined += to - from;
+    int i = evaluateCandidatesSIMD<lN, WEIGHT_MAP>(sdims, weights, from, to, yk, lScale, Mh, wsuml, counters);
+
+    // scalar tail (or the whole range if SIMD is not available)
+    for (; i < to; i++) {
+        real_type el, diff;
+
+        // determine if inside search window
+        el = sdims[0][i]-yk[0];
+        diff = el*el;
+        el = sdims[1][i]-yk[1];
+        diff += el*el;
+
+        if (diff < 1.0) {
+            el = sdims[2][i]-yk[2];
+            diff = lScale*el*el;
+
+            if (lN > 3) {
+                el = sdims[3][i]-yk[3];
+                diff += el*el;
+                el = sdims[4][i]-yk[4];
+                diff += el*el;
+            }
+
+            if (diff < 1.0) {
+                real_type weight = WEIGHT_MAP ? weights[i] : 1;
+                for (int k = 0; k < lN; k++)
+                    Mh[k] += weight*sdims[k][i];
+                wsuml += weight;
+                counters.accepted++;
+            }
+        }
+    }
+}
+
+#if defined(MS_KERNELS_AVX512)
+inline long long horizontalSum(__m512i v)
+{
+    alignas(64) int lanes[16];
+    _mm512_store_si512(lanes, v);
+    long long sum = 0;
+    for (int k = 0; k < 16; k++)
+        sum += lanes[k];
+    return sum;
+}
+#elif defined(MS_KERNELS_AVX2)
+inline long long horizontalSum(__m256i v)
+{
+    alignas(32) int lanes[8];
+    _mm256_store_si256((__m256i*) lanes, v);
+    long long sum = 0;
+    for (int k = 0; k < 8; k++)
+        sum += lanes[k];
+    return sum;
+}
+#elif defined(MS_KERNELS_SSE2)
+inline long long horizontalSum(__m128i v)
+{
+    alignas(16) int lanes[4];
+    _mm_store_si128((__m128i*) lanes, v);
+    return (long long) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+// SIMD part of evaluateQuantizedCandidates: 32 (AVX-512), 16 (AVX2) or 8 (SSE2) int16 candidates per iteration,
+// squared distances are computed with multiply-add of interleaved differences into int32,
+// accepted points are masked and accumulated into int32 lanes. Returns index of the first candidate that was not processed.
+template <int lN, bool WEIGHT_MAP>
+inline int evaluateQuantizedSIMD(const QuantizedPoints &q, const int from, const int to,
+                                 const QuantizedWindow &window, QuantizedSums &sums)
+{
+    int i = from;
+
+#if defined(MS_KERNELS_AVX512)
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i ones = _mm512_set1_epi16(1);
+    const __m512i spatialLimit = _mm512_set1_epi32(window.spatialLimit);
+    const __m512i rangeLimit = _mm512_set1_epi32(window.rangeLimit);
+    const __m128i lShift = _mm_cvtsi32_si128(window.lShift);
+    __m512i yk[lN];
+    for (int k = 0; k < lN; k++)
+        yk[k] = _mm512_set1_epi16((short) window.yk[k]);
+
+    __m512i acc[lN + 1];
+    for (int k = 0; k <= lN; k++)
+        acc[k] = zero;
+    int pending = 0;
+    auto flush = [&]()
+    {
+        for (int k = 0; k < lN; k++)
+            sums.s[k] += horizontalSum(acc[k]);
+        sums.w += horizontalSum(acc[lN]);
+        for (int k = 0; k <= lN; k++)
+            acc[k] = zero;
+        pending = 0;
+    };
+
+    for (; i + 32 <= to; i += 32) {
+        // determine if inside spatial search window
+        __m512i dx = _mm512_sub_epi16(_mm512_loadu_si512(q.sdims[0] + i), yk[0]);
+        __m512i dy = _mm512_sub_epi16(_mm512_loadu_si512(q.sdims[1] + i), yk[1]);
+        __m512i lo = _mm512_unpacklo_epi16(dx, dy);
+        __m512i hi = _mm512_unpackhi_epi16(dx, dy);
+        lo = _mm512_madd_epi16(lo, lo);
+        hi = _mm512_madd_epi16(hi, hi);
+        // packing of the unpacked halves restores the order of candidates
+        __m512i inside = _mm512_packs_epi32(_mm512_movm_epi32(_mm512_cmpgt_epi32_mask(spatialLimit, lo)),
+                                            _mm512_movm_epi32(_mm512_cmpgt_epi32_mask(spatialLimit, hi)));
+        if (_mm512_test_epi16_mask(inside, inside) == 0)
+            continue;
+
+        // determine if inside range search window
+        __m512i dl = _mm512_sll_epi16(_mm512_sub_epi16(_mm512_loadu_si512(q.sdims[2] + i), yk[2]), lShift);
+        if (lN > 3) {
+            __m512i du = _mm512_sub_epi16(_mm512_loadu_si512(q.sdims[3] + i), yk[3]);
+            __m512i dv = _mm512_sub_epi16(_mm512_loadu_si512(q.sdims[4] + i), yk[4]);
+            lo = _mm512_unpacklo_epi16(dl, du);
+            hi = _mm512_unpackhi_epi16(dl, du);
+            __m512i lo2 = _mm512_unpacklo_epi16(dv, zero);
+            __m512i hi2 = _mm512_unpackhi_epi16(dv, zero);
+            lo = _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(lo2, lo2));
+            hi = _mm512_add_epi32(_mm512_madd_epi16(hi, hi), _mm512_madd_epi16(hi2, hi2));
+        } else {
+            lo = _mm512_unpacklo_epi16(dl, zero);
+            hi = _mm512_unpackhi_epi16(dl, zero);
+            lo = _mm512_madd_epi16(lo, lo);
+            hi = _mm512_madd_epi16(hi, hi);
+        }
+        inside = _mm512_and_si512(inside, _mm512_packs_epi32(_mm512_movm_epi32(_mm512_cmpgt_epi32_mask(rangeLimit, lo)),
+                                                             _mm512_movm_epi32(_mm512_cmpgt_epi32_mask(rangeLimit, hi))));
+        const unsigned int mask = _mm512_movepi16_mask(inside);
+        if (mask == 0)
+            continue;
+        sums.accepted += bitsCount(mask);
+
+        // accumulate weighted points
+        const __m512i w = WEIGHT_MAP ? _mm512_loadu_si512(q.weights + i) : ones;
+        for (int k = 0; k < lN; k++) {
+            __m512i masked = _mm512_and_si512(_mm512_loadu_si512(q.sdims[k] + i), inside);
+            acc[k] = _mm512_add_epi32(acc[k], _mm512_madd_epi16(masked, w));
+        }
+        acc[lN] = _mm512_add_epi32(acc[lN], _mm512_madd_epi16(_mm512_and_si512(w, inside), ones));
+        if (++pending == MS_QUANTIZED_FLUSH_PERIOD)
+            flush();
+    }
+    flush();
+#elif defined(MS_KERNELS_AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i spatialLimit = _mm256_set1_epi32(window.spatialLimit);
+    const __m256i rangeLimit = _mm256_set1_epi32(window.rangeLimit);
+    const __m128i lShift = _mm_cvtsi32_si128(window.lShift);
+    __m256i yk[lN];
+    for (int k = 0; k < lN; k++)
+        yk[k] = _mm256_set1_epi16((short) window.yk[k]);
+
+    __m256i acc[lN + 1];
+    for (int k = 0; k <= lN; k++)
+        acc[k] = zero;
+    int pending = 0;
+    auto flush = [&]()
+    {
+        for (int k = 0; k < lN; k++)
+            sums.s[k] += horizontalSum(acc[k]);
+        sums.w += horizontalSum(acc[lN]);
+        for (int k = 0; k <= lN; k++)
+            acc[k] = zero;
+        pending = 0;
+    };
+
+    for (; i + 16 <= to; i += 16) {
+        // determine if inside spatial search window
+        __m256i dx = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (q.sdims[0] + i)), yk[0]);
+        __m256i dy = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (q.sdims[1] + i)), yk[1]);
+        __m256i lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i hi = _mm256_unpackhi_epi16(dx, dy);
+        lo = _mm256_madd_epi16(lo, lo);
+        hi = _mm256_madd_epi16(hi, hi);
+        // packing of the unpacked halves restores the order of candidates
+        __m256i inside = _mm256_packs_epi32(_mm256_cmpgt_epi32(spatialLimit, lo), _mm256_cmpgt_epi32(spatialLimit, hi));
+        if (_mm256_testz_si256(inside, inside))
+            continue;
+
+        // determine if inside range search window
+        __m256i dl = _mm256_sll_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (q.sdims[2] + i)), yk[2]), lShift);
+        if (lN > 3) {
+            __m256i du = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (q.sdims[3] + i)), yk[3]);
+            __m256i dv = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) (q.sdims[4] + i)), yk[4]);
+            lo = _mm256_unpacklo_epi16(dl, du);
+            hi = _mm256_unpackhi_epi16(dl, du);
+            __m256i lo2 = _mm256_unpacklo_epi16(dv, zero);
+            __m256i hi2 = _mm256_unpackhi_epi16(dv, zero);
+            lo = _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(lo2, lo2));
+            hi = _mm256_add_epi32(_mm256_madd_epi16(hi, hi), _mm256_madd_epi16(hi2, hi2));
+        } else {
+            lo = _mm256_unpacklo_epi16(dl, zero);
+            hi = _mm256_unpackhi_epi16(dl, zero);
+            lo = _mm256_madd_epi16(lo, lo);
+            hi = _mm256_madd_epi16(hi, hi);
+        }
+        inside = _mm256_and_si256(inside, _mm256_packs_epi32(_mm256_cmpgt_epi32(rangeLimit, lo), _mm256_cmpgt_epi32(rangeLimit, hi)));
+        const unsigned int mask = _mm256_movemask_epi8(inside);
+        if (mask == 0)
+            continue;
+        sums.accepted += bitsCount(mask)/2;
+
+        // accumulate weighted points
+        const __m256i w = WEIGHT_MAP ? _mm256_loadu_si256((const __m256i*) (q.weights + i)) : ones;
+        for (int k = 0; k < lN; k++) {
+            __m256i masked = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (q.sdims[k] + i)), inside);
+            acc[k] = _mm256_add_epi32(acc[k], _mm256_madd_epi16(masked, w));
+        }
+        acc[lN] = _mm256_add_epi32(acc[lN], _mm256_madd_epi16(_mm256_and_si256(w, inside), ones));
+        if (++pending == MS_QUANTIZED_FLUSH_PERIOD)
+            flush();
+    }
+    flush();
+#elif defined(MS_KERNELS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i spatialLimit = _mm_set1_epi32(window.spatialLimit);
+    const __m128i rangeLimit = _mm_set1_epi32(window.rangeLimit);
+    const __m128i lShift = _mm_cvtsi32_si128(window.lShift);
+    __m128i yk[lN];
+    for (int k = 0; k < lN; k++)
+        yk[k] = _mm_set1_epi16((short) window.yk[k]);
+
+    __m128i acc[lN + 1];
+    for (int k = 0; k <= lN; k++)
+        acc[k] = zero;
+    int pending = 0;
+    auto flush = [&]()
+    {
+        for (int k = 0; k < lN; k++)
+            sums.s[k] += horizontalSum(acc[k]);
+        sums.w += horizontalSum(acc[lN]);
+        for (int k = 0; k <= lN; k++)
+            acc[k] = zero;
+        pending = 0;
+    };
+
+    for (; i + 8 <= to; i += 8) {
+        // determine if inside spatial search window
+        __m128i dx = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (q.sdims[0] + i)), yk[0]);
+        __m128i dy = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (q.sdims[1] + i)), yk[1]);
+        __m128i lo = _mm_unpacklo_epi16(dx, dy);
+        __m128i hi = _mm_unpackhi_epi16(dx, dy);
+        lo = _mm_madd_epi16(lo, lo);
+        hi = _mm_madd_epi16(hi, hi);
+        __m128i inside = _mm_packs_epi32(_mm_cmpgt_epi32(spatialLimit, lo), _mm_cmpgt_epi32(spatialLimit, hi));
+        if (_mm_movemask_epi8(inside) == 0)
+            continue;
+
+        // determine if inside range search window
+        __m128i dl = _mm_sll_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i*) (q.sdims[2] + i)), yk[2]), lShift);
+        if (lN > 3) {
+            __m128i du = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (q.sdims[3] + i)), yk[3]);
+            __m128i dv = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) (q.sdims[4] + i)), yk[4]);
+            lo = _mm_unpacklo_epi16(dl, du);
+            hi = _mm_unpackhi_epi16(dl, du);
+            __m128i lo2 = _mm_unpacklo_epi16(dv, zero);
+            __m128i hi2 = _mm_unpackhi_epi16(dv, zero);
+            lo = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(lo2, lo2));
+            hi = _mm_add_epi32(_mm_madd_epi16(hi, hi), _mm_madd_epi16(hi2, hi2));
+        } else {
+            lo = _mm_unpacklo_epi16(dl, zero);
+            hi = _mm_unpackhi_epi16(dl, zero);
+            lo = _mm_madd_epi16(lo, lo);
+            hi = _mm_madd_epi16(hi, hi);
+        }
+        inside = _mm_and_si128(inside, _mm_packs_epi32(_mm_cmpgt_epi32(rangeLimit, lo), _mm_cmpgt_epi32(rangeLimit, hi)));
+        const unsigned int mask = _mm_movemask_epi8(inside);
+        if (mask == 0)
+            continue;
+        sums.accepted += bitsCount(mask)/2;
+
+        // accumulate weighted points
+        const __m128i w = WEIGHT_MAP ? _mm_loadu_si128((const __m128i*) (q.weights + i)) : ones;
+        for (int k = 0; k < lN; k++) {
+            __m128i masked = _mm_and_si128(_mm_loadu_si128((const __m128i*) (q.sdims[k] + i)), inside);
+            acc[k] = _mm_add_epi32(acc[k], _mm_madd_epi16(masked, w));
+        }
+        acc[lN] = _mm_add_epi32(acc[lN], _mm_madd_epi16(_mm_and_si128(w, inside), ones));
+        if (++pending == MS_QUANTIZED_FLUSH_PERIOD)
+            flush();
+    }
+    flush();
+#endif
+
+    return i;
+}
+
+// Adds to the sums all quantized points [from, to) that are inside of the window
+// (all arithmetic is integer, so SIMD and scalar paths give the same sums)
+template <int lN, bool WEIGHT_MAP>
+void evaluateQuantizedCandidates(const QuantizedPoints &q, const int from, const int to,
+                                 const QuantizedWindow &window, QuantizedSums &sums)
+{
+    sums.examined += to - from;
+    int i = evaluateQuantizedSIMD<lN, WEIGHT_MAP>(q, from, to, window, sums);
+
+    // scalar tail (or the whole range if SIMD is not available)
+    for (; i < to; i++) {
+        int el = q.sdims[0][i] - window.yk[0];
+        int diff = el*el;
+        el = q.sdims[1][i] - window.yk[1];
+        diff += el*el;
+        if (diff >= window.spatialLimit)
+            continue;
+
+        el = (q.sdims[2][i] - window.yk[2])*(1 << window.lShift);
+        diff = el*el;
+        for (int k = 3; k < lN; k++) {
+            el = q.sdims[k][i] - window.yk[k];
+            diff += el*el;
+        }
+        if (diff >= window.rangeLimit)
+            continue;
+
+        const int w = WEIGHT_MAP ? q.weights[i] : 1;
+        for (int k = 0; k < lN; k++)
+            sums.s[k] += w*q.sdims[k][i];
+        sums.w += w;
+        sums.accepted++;
+    }
+}
+
+// the same arithmetic as msImageProcessor::RGBtoLUV (the loop is left to the auto-vectorizer of the instruction set,
+// but cube root is computed with pow as there, so results are equal)
+void rgbToLuv(const unsigned char* rgb, float* luv, int n)
+{
+    for (int i = 0; i < n; i++) {
+        const unsigned char* rgbVal = rgb + 3*i;
+        float* luvVal = luv + 3*i;
+
+        double x = XYZ[0][0]*rgbVal[0] + XYZ[0][1]*rgbVal[1] + XYZ[0][2]*rgbVal[2];
+        double y = XYZ[1][0]*rgbVal[0] + XYZ[1][1]*rgbVal[1] + XYZ[1][2]*rgbVal[2];
+        double z = XYZ[2][0]*rgbVal[0] + XYZ[2][1]*rgbVal[1] + XYZ[2][2]*rgbVal[2];
+
+        double L0 = y / (255.0 * Yn);
+        if (L0 > Lt)
+            luvVal[0] = (float)(116.0 * (pow(L0, 1.0/3.0)) - 16.0);
+        else
+            luvVal[0] = (float)(903.3 * L0);
+
+        double constant = x + 15 * y + 3 * z;
+        double u_prime, v_prime;
+        if (constant != 0) {
+            u_prime = (4 * x) / constant;
+            v_prime = (9 * y) / constant;
+        } else {
+            u_prime = 4.0;
+            v_prime = 9.0/15.0;
+        }
+
+        luvVal[1] = (float) (13 * luvVal[0] * (u_prime - Un_prime));
+        luvVal[2] = (float) (13 * luvVal[0] * (v_prime - Vn_prime));
+    }
+}
+
+// number of pixels compared at once by similarityMasks (channels of a chunk are compared as a flat array of floats)
+#define MS_SIMILARITY_CHUNK 1024
+
+// compares n floats: flags[j] = |a[j]-b[j]| < threshold (written without fabs, so that no inline function of the standard
+// library is instantiated with the instruction set of this translation unit)
+template <int n>
+inline void compareFloats(const float* a, const float* b, const float threshold, unsigned char* flags)
+{
+    for (int j = 0; j < n; j++) {
+        const float diff = a[j] - b[j];
+        flags[j] = (unsigned char) (!(diff >= threshold) & !(-diff >= threshold));
+    }
+}
+
+// Channels are compared as flat arrays of floats by chunks of constant size (so the loop is vectorized by the compiler
+// for the instruction set of the translation unit even with its cheapest cost model), then flags of channels
+// of each pixel are combined
+template <int N>
+void similarityMasksImpl(const float* luv, const int L, const int width, const float threshold, unsigned char* masks)
+{
+    const int offsets[4] = {1, width - 1, width, width + 1};
+    unsigned char flags[N*MS_SIMILARITY_CHUNK];
+    for (int p = 0; p < L; p++)
+        masks[p] = 0;
+    for (int d = 0; d < 4; d++) {
+        const int end = L - offsets[d];
+        for (int from = 0; from < end; from += MS_SIMILARITY_CHUNK) {
+            const int count = (end - from < MS_SIMILARITY_CHUNK) ? end - from : MS_SIMILARITY_CHUNK;
+            const float* a = luv + N*from;
+            const float* b = luv + N*(from + offsets[d]);
+            if (count == MS_SIMILARITY_CHUNK)
+                compareFloats<N*MS_SIMILARITY_CHUNK>(a, b, threshold, flags);
+            else
+                for (int j = 0; j < N*count; j++)
+                    compareFloats<1>(a + j, b + j, threshold, flags + j);
+            for (int p = 0; p < count; p++) {
+                unsigned char similar = flags[N*p];
+                for (int k = 1; k < N; k++)
+                    similar &= flags[N*p + k];
+                masks[from + p] |= (unsigned char) (similar << d);
+            }
+        }
+    }
+}
+
+void similarityMasks(const float* luv, int N, int L, int width, float threshold, unsigned char* masks)
+{
+    if (N == 3)
+        similarityMasksImpl<3>(luv, L, width, threshold, masks);
+    else
+        similarityMasksImpl<1>(luv, L, width, threshold, masks);
+}
+
+const CpuKernels implKernels = {
+    kernelsIsa,
+    kernelsName,
+    {{evaluateCandidates<double, 3, false>, evaluateCandidates<double, 3, true>},
+     {evaluateCandidates<double, 5, false>, evaluateCandidates<double, 5, true>}},
+    {{evaluateCandidates<float, 3, false>, evaluateCandidates<float, 3, true>},
+     {evaluateCandidates<float, 5, false>, evaluateCandidates<float, 5, true>}},
+    {{evaluateQuantizedCandidates<3, false>, evaluateQuantizedCandidates<3, true>},
+     {evaluateQuantizedCandidates<5, false>, evaluateQuantizedCandidates<5, true>}},
+    rgbToLuv,
+    similarityMasks,
+};
+
+}
@@ -0,0 +1,8 @@
+// Variant of CPU kernels without SIMD intrinsics (for benchmarks, and for CPUs other than x86)
+#define MS_CPU_KERNELS_NO_SIMD
+#include "ms_cpu_kernels_impl.h"
+
+const CpuKernels* scalarCpuKernels()
+{
+    return &implKernels;
+}
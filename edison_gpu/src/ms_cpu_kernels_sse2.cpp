@@ -0,0 +1,8 @@
+// SSE2 variant of CPU kernels (compiled with the default flags, SSE2 is the baseline of x86-64)
+#include "ms_cpu_kernels_impl.h"
+
+// nullptr if the compiler did not enable the instruction set for this file (e.g. on CPUs other than x86)
+const CpuKernels* sse2CpuKernels()
+{
+    return implKernels.isa == CPU_ISA_SSE2 ? &implKernels : nullptr;
+}
@@ -0,0 +1,327 @@
+#include "../segm/msImageProcessor.h"
+#include "ms_lattice.h"
+#include "timer.h"
+#include "ms_work_stealing.h"
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+
+// number of cells of the bilateral grid per sigma in each dimension of the feature space
+// (1 - a cell is as large as the search window radius, more cells per sigma are more accurate but slower)
+#ifndef MS_GRID_CELLS_PER_SIGMA
+#define MS_GRID_CELLS_PER_SIGMA 1
+#endif
+
+// number of pixels in a block of work stealing pool
+#define MS_GRID_WORK_BLOCK_SIZE 256
+
+namespace {
+
+// Downsampled bilateral grid of the (x, y, L[, u, v]) feature space scaled by sigmaS and sigmaR:
+// each occupied cell stores weighted sums of its points. Cells are bucket-sorted by their centroids
+// into (x, y, L) buckets of the search window size, so a search window needs only 27 neighbour buckets
+// (the same way as points are sorted in MeanShiftLattice).
+struct BilateralGrid {
+	int lN;
+	std::vector<double> sums;       // lN per cell, sorted by bucket - weighted sums of points of the cell
+	std::vector<double> centroids;  // lN per cell, sorted by bucket - sums divided by weights
+	std::vector<double> weights;    // per cell, sorted by bucket - sum of kernel weights (1-weightMap) of points of the cell
+
+	int nBuck1, nBuck2, nBuck3;
+	double sMins;                   // minimal L (scaled)
+	std::vector<int> bucketStart;   // nBuck1*nBuck2*nBuck3 + 1, cells of bucket b are [bucketStart[b], bucketStart[b + 1])
+	int bucNeigh[27];
+
+	// returns false if the grid of buckets is too large
+	bool build(const float* data, const float* weightMap, int N, int width, int height, float sigmaS, float sigmaR);
+
+	int bucketOf(const double* y) const
+	{
+		int cBuck1 = (int) y[0] + 1;
+		int cBuck2 = (int) y[1] + 1;
+		int cBuck3 = (int) (y[2] - sMins) + 1;
+		return cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
+	}
+};
+
+bool BilateralGrid::build(const float* data, const float* weightMap, int N, int width, int height, float sigmaS, float sigmaR)
+{
+	lN = N + 2;
+	const int L = width*height;
+	const double cellsPerSigma = MS_GRID_CELLS_PER_SIGMA;
+
+	// range of each channel (scaled)
+	double rangeMins[3], rangeMaxs[3];
+	for (int k = 0; k < N; k++)
+		rangeMins[k] = rangeMaxs[k] = data[k]/sigmaR;
+	for (int i = 0; i < L; i++) {
+		for (int k = 0; k < N; k++) {
+			double cval = data[i*N + k]/sigmaR;
+			rangeMins[k] = std::min(rangeMins[k], cval);
+			rangeMaxs[k] = std::max(rangeMaxs[k], cval);
+		}
+	}
+	sMins = rangeMins[0];
+
+	nBuck1 = (int) (width/sigmaS + 3);
+	nBuck2 = (int) (height/sigmaS + 3);
+	nBuck3 = (int) (rangeMaxs[0] - sMins + 3);
+	if ((long long) nBuck1*nBuck2*nBuck3*sizeof(int) > MS_LATTICE_MAX_DENSE_BYTES)
+		return false;
+
+	// cell key of each pixel in mixed radix of cells numbers of all dimensions
+	long long cellsNumber[5];
+	cellsNumber[0] = (long long) (width/sigmaS*cellsPerSigma) + 1;
+	cellsNumber[1] = (long long) (height/sigmaS*cellsPerSigma) + 1;
+	for (int k = 0; k < N; k++)
+		cellsNumber[k + 2] = (long long) ((rangeMaxs[k] - rangeMins[k])*cellsPerSigma) + 1;
+
+	std::vector<std::pair<long long, int>> keys(L);
+	#pragma omp parallel for
+	for (int i = 0; i < L; i++) {
+		long long cell[5];
+		cell[0] = (long long) ((i%width)/sigmaS*cellsPerSigma);
+		cell[1] = (long long) ((i/width)/sigmaS*cellsPerSigma);
+		for (int k = 0; k < N; k++)
+			cell[k + 2] = (long long) ((data[i*N + k]/sigmaR - rangeMins[k])*cellsPerSigma);
+		long long key = 0;
+		for (int k = lN - 1; k >= 0; k--)
+			key = key*cellsNumber[k] + cell[k];
+		keys[i] = std::make_pair(key, i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	// accumulate weighted and plain sums of points of cells
+	std::vector<double> cellSums, cellPlainSums;
+	std::vector<double> cellWeights;
+	std::vector<int> cellCounts;
+	for (int p = 0; p < L; p++) {
+		if (p == 0 || keys[p].first != keys[p - 1].first) {
+			cellSums.resize(cellSums.size() + lN, 0.0);
+			cellPlainSums.resize(cellPlainSums.size() + lN, 0.0);
+			cellWeights.push_back(0.0);
+			cellCounts.push_back(0);
+		}
+		const int i = keys[p].second;
+		const double weight = weightMap ? 1 - weightMap[i] : 1;
+		double point[5];
+		point[0] = (i%width)/sigmaS;
+		point[1] = (i/width)/sigmaS;
+		for (int k = 0; k < N; k++)
+			point[k + 2] = data[i*N + k]/sigmaR;
+		double* sum = &cellSums[cellSums.size() - lN];
+		double* plainSum = &cellPlainSums[cellPlainSums.size() - lN];
+		for (int k = 0; k < lN; k++) {
+			sum[k] += weight*point[k];
+			plainSum[k] += point[k];
+		}
+		cellWeights.back() += weight;
+		cellCounts.back()++;
+	}
+	const int cells = (int) cellWeights.size();
+
+	// centroids of cells with zero weight are taken as if all weights were equal
+	std::vector<double> cellCentroids(cells*lN);
+	std::vector<int> cellBuckets(cells);
+	for (int c = 0; c < cells; c++) {
+		for (int k = 0; k < lN; k++)
+			cellCentroids[c*lN + k] = (cellWeights[c] > 0) ? cellSums[c*lN + k]/cellWeights[c] : cellPlainSums[c*lN + k]/cellCounts[c];
+		cellBuckets[c] = bucketOf(&cellCentroids[c*lN]);
+	}
+
+	// bucket sort of cells by their centroids
+	bucketStart.assign((size_t) nBuck1*nBuck2*nBuck3 + 1, 0);
+	for (int c = 0; c < cells; c++)
+		bucketStart[cellBuckets[c] + 1]++;
+	for (size_t b = 1; b < bucketStart.size(); b++)
+		bucketStart[b] += bucketStart[b - 1];
+	std::vector<int> next(bucketStart.begin(), bucketStart.end() - 1);
+	sums.resize(cells*lN);
+	centroids.resize(cells*lN);
+	weights.resize(cells);
+	for (int c = 0; c < cells; c++) {
+		const int d = next[cellBuckets[c]]++;
+		for (int k = 0; k < lN; k++) {
+			sums[d*lN + k] = cellSums[c*lN + k];
+			centroids[d*lN + k] = cellCentroids[c*lN + k];
+		}
+		weights[d] = cellWeights[c];
+	}
+
+	int idxd = 0;
+	for (int cBuck1 = -1; cBuck1 <= 1; cBuck1++)
+		for (int cBuck2 = -1; cBuck2 <= 1; cBuck2++)
+			for (int cBuck3 = -1; cBuck3 <= 1; cBuck3++)
+				bucNeigh[idxd++] = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
+	return true;
+}
+
+// Computes mean shift vector Mh at yk using cells of the grid which centroids are inside of the search window
+// instead of points (cell is either taken with all its points or not taken at all)
+template <int lN>
+static inline void computeGridMSVector(const BilateralGrid &grid, const double hiLTr, const double* yk, double* Mh,
+									   long long &examined, long long &accepted)
+{
+	double wsuml = 0;
+	for (int j = 0; j < lN; j++)
+		Mh[j] = 0;
+	const double lScale = (yk[2] > hiLTr) ? 4 : 1;
+
+	const int cBuck = grid.bucketOf(yk);
+	for (int j = 0; j < 27; j++) {
+		const int from = grid.bucketStart[cBuck + grid.bucNeigh[j]];
+		const int to = grid.bucketStart[cBuck + grid.bucNeigh[j] + 1];
+		examined += to - from;
+		for (int c = from; c < to; c++) {
+			const double* centroid = &grid.centroids[c*lN];
+			// determine if inside search window
+			double el = centroid[0] - yk[0];
+			double diff = el*el;
+			el = centroid[1] - yk[1];
+			diff += el*el;
+			if (diff >= 1.0)
+				continue;
+
+			el = centroid[2] - yk[2];
+			diff = lScale*el*el;
+			for (int k = 3; k < lN; k++) {
+				el = centroid[k] - yk[k];
+				diff += el*el;
+			}
+			if (diff >= 1.0)
+				continue;
+
+			const double* sum = &grid.sums[c*lN];
+			for (int k = 0; k < lN; k++)
+				Mh[k] += sum[k];
+			wsuml += grid.weights[c];
+			accepted++;
+		}
+	}
+
+	if (wsuml > 0) {
+		for (int j = 0; j < lN; j++)
+			Mh[j] = Mh[j]/wsuml - yk[j];
+	} else {
+		for (int j = 0; j < lN; j++)
+			Mh[j] = 0;
+	}
+}
+
+}
+
+template <int CHANNELS>
+void msImageProcessor::NewNonOptimizedFilter_grid_impl(float sigmaS, float sigmaR)
+{
+	// number of channels is known at compile time (hides MeanShift::N)
+	const int N = CHANNELS;
+	const int lN = N + 2;
+
+	//make sure that a lattice height and width have
+	//been defined...
+	if(!height)
+	{
+		ErrorHandler("msImageProcessor", "LFilter", "Lattice height and width are undefined.");
+		return;
+	}
+
+	//re-assign bandwidths to sigmaS and sigmaR
+	if(((h[0] = sigmaS) <= 0)||((h[1] = sigmaR) <= 0))
+	{
+		ErrorHandler("msImageProcessor", "Segment", "sigmaS and/or sigmaR is zero or negative.");
+		return;
+	}
+
+	performance_timer preprocessingTimer;
+	BilateralGrid grid;
+	if (!grid.build(data, weightMapDefined ? weightMap : nullptr, N, width, height, sigmaS, sigmaR)) {
+		// grid of buckets would not fit into memory - fall back to the exact filter
+		NewNonOptimizedFilter_omp(sigmaS, sigmaR);
+		return;
+	}
+	ReportPreprocessingTime(preprocessingTimer.elapsed());
+
+	const double hiLTr = 80.0/sigmaR;
+
+	std::atomic<long long> candidatesExamined(0);
+	std::atomic<long long> candidatesAccepted(0);
+	std::atomic<long long> iterations(0);
+	auto processBlock = [&](int blockFrom, int blockTo)
+	{
+		long long examined = 0, accepted = 0, blockIterations = 0;
+		for (int i = blockFrom; i < blockTo; i++) {
+			double yk[lN], Mh[lN];
+			double mvAbs;
+			int j;
+
+			// Assign window center to the data point data[i]
+			yk[0] = (i%width)/sigmaS;
+			yk[1] = (i/width)/sigmaS;
+			for (j = 0; j < N; j++)
+				yk[j + 2] = data[N*i + j]/sigmaR;
+
+			// Calculate the mean shift vector using the grid
+			computeGridMSVector<lN>(grid, hiLTr, yk, Mh, examined, accepted);
+
+			// Calculate its magnitude squared
+			mvAbs = 0;
+			for (j = 0; j < lN; j++)
+				mvAbs += Mh[j]*Mh[j];
+
+			// Keep shifting window center until the magnitude squared of the
+			// mean shift vector calculated at the window center location is
+			// under a specified threshold (Epsilon)
+			int iterationCount = 1;
+			while ((mvAbs >= EPSILON) && (iterationCount < LIMIT)) {
+				// Shift window location
+				for (j = 0; j < lN; j++)
+					yk[j] += Mh[j];
+
+				computeGridMSVector<lN>(grid, hiLTr, yk, Mh, examined, accepted);
+
+				mvAbs = (Mh[0]*Mh[0] + Mh[1]*Mh[1])*sigmaS*sigmaS;
+				for (j = 2; j < lN; j++)
+					mvAbs += Mh[j]*Mh[j]*sigmaR*sigmaR;
+
+				iterationCount++;
+			}
+
+			// Shift window location
+			for (j = 0; j < lN; j++)
+				yk[j] += Mh[j];
+			blockIterations += iterationCount;
+
+			//store result into msRawData...
+			for (j = 0; j < N; j++)
+				msRawData[N*i + j] = (float) (yk[j + 2]*sigmaR);
+		}
+		candidatesExamined += examined;
+		candidatesAccepted += accepted;
+		iterations += blockIterations;
+	};
+
+	bool fetched = false;
+	auto fetchImage = [&](int &workFrom, int &workTo) -> bool
+	{
+		if (fetched)
+			return false;
+		fetched = true;
+		workFrom = 0;
+		workTo = L;
+		return true;
+	};
+	filterStatistics.threadsIdleTime = WorkStealingPool::instance().run(fetchImage, processBlock, MS_GRID_WORK_BLOCK_SIZE);
+	filterStatistics.candidatesExamined += candidatesExamined;
+	filterStatistics.candidatesAccepted += candidatesAccepted;
+	filterStatistics.iterations += iterations;
+}
+
+void msImageProcessor::NewNonOptimizedFilter_grid(float sigmaS, float sigmaR)
+{
+	if (N == 3)
+		NewNonOptimizedFilter_grid_impl<3>(sigmaS, sigmaR);
+	else
+		NewNonOptimizedFilter_grid_impl<1>(sigmaS, sigmaR);
+}
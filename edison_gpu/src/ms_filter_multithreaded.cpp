@@ -1,18 +1,445 @@
 #include "../segm/msImageProcessor.h"
+#include "ms_lattice.h"
+#include "timer.h"
+#include "ms_work_stealing.h"
+#include "ms_cpu_kernels.h"
+#include "ms_flat_regions.h"
 
-#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
-typedef double real_type;
+// number of pixels in a block of work stealing pool (about a millisecond of work on textured images)
+#define MS_WORK_BLOCK_SIZE 128
+
+// side of square tile of pixels (in pixels) in the tiled filter is about sigmaS (i.e. a bucket) but limited with these values
+#define MS_TILE_MIN_SIZE 16
+#define MS_TILE_MAX_SIZE 64
+// number of buckets by which the envelope of the tile is extended in each direction for the trajectories of its pixels
+#define MS_TILE_MARGIN 1
+
+// Adds to the mean shift vector Mh all sorted lattice points [from, to) that are inside of the search window centered at yk
+// (with the kernel of the instruction set selected at startup, see ms_cpu_kernels.h)
+template <int lN, bool WEIGHT_MAP>
+static inline void evaluateCandidates(const double* const* sdims, const float* weights,
+                                      const int from, const int to,
+                                      const double* yk, const double lScale,
+                                      double* Mh, double &wsuml, FilterCounters &counters)
+{
+    cpuKernels().evaluateCandidates[lN == 5][WEIGHT_MAP](sdims, weights, from, to, yk, lScale, Mh, wsuml, counters);
+}
+
+template <int lN, bool WEIGHT_MAP>
+static inline void evaluateCandidates(const float* const* sdims, const float* weights,
+                                      const int from, const int to,
+                                      const float* yk, const float lScale,
+                                      float* Mh, float &wsuml, FilterCounters &counters)
+{
+    cpuKernels().evaluateCandidatesFloat[lN == 5][WEIGHT_MAP](sdims, weights, from, to, yk, lScale, Mh, wsuml, counters);
+}
+
+// Adds to the mean shift vector Mh candidates from 27 neighbour buckets of the bucket (cBuck1, cBuck2, cBuck3) of the index
+// (lattice or tile) - as 9 contiguous ranges of three buckets adjacent along L
+template <int lN, bool WEIGHT_MAP, typename real_type, typename Index>
+static inline void evaluateNeighbourBuckets(const Index &index, const int cBuck1, const int cBuck2, const int cBuck3,
+                                            const real_type* const* sdims, const float* weights,
+                                            const real_type* yk, const real_type lScale,
+                                            real_type* Mh, real_type &wsuml, FilterCounters &counters)
+{
+    for (int dBuck1 = -1; dBuck1 <= 1; dBuck1++) {
+        for (int dBuck2 = -1; dBuck2 <= 1; dBuck2++) {
+            int from, to;
+            index.neighbourRange(cBuck1 + dBuck1, cBuck2 + dBuck2, cBuck3, from, to);
+            evaluateCandidates<lN, WEIGHT_MAP>(sdims, weights, from, to, yk, lScale, Mh, wsuml, counters);
+        }
+    }
+}
+
+// The same as evaluateNeighbourBuckets for the lattice with 5d buckets (x, y, L, u, v).
+// Of 3x3 neighbours along x and y and (2*MS_COLOR_BUCKETS_PER_SIGMA+1)^2 neighbours along u and v
+// only buckets that can intersect with the search window are scanned: bucket is skipped if the squared distance
+// from yk to it along x and y (or along u and v) is not less than 1.
+template <int lN, bool WEIGHT_MAP, typename real_type>
+static inline void evaluateColorNeighbourBuckets(const MeanShiftLattice<real_type> &lattice, const int cBuck1, const int cBuck2, const int cBuck3,
+                                                 const real_type* const* sdims, const float* weights,
+                                                 const real_type* yk, const real_type lScale,
+                                                 real_type* Mh, real_type &wsuml, FilterCounters &counters)
+{
+    const int K = MS_COLOR_BUCKETS_PER_SIGMA;
+
+    int cBuck4, cBuck5;
+    lattice.colorBucketOf(yk, cBuck4, cBuck5);
+
+    // squared distances from yk to neighbour buckets along x and y
+    real_type distXY[2][3];
+    for (int k = 0; k < 2; k++) {
+        const real_type low = (real_type) ((k == 0 ? cBuck1 : cBuck2) - 1);
+        distXY[k][0] = (yk[k] - low)*(yk[k] - low);
+        distXY[k][1] = 0;
+        distXY[k][2] = (low + 1 - yk[k])*(low + 1 - yk[k]);
+    }
+
+    // squared distances from yk to neighbour buckets along u and v
+    real_type distUV[2][2*K + 1];
+    for (int k = 0; k < 2; k++) {
+        const int cBuck = (k == 0) ? cBuck4 : cBuck5;
+        for (int d = -K; d <= K; d++) {
+            real_type dist = 0;
+            if (d < 0)
+                dist = yk[3 + k] - lattice.colorBucketLow(k, cBuck + d + 1);
+            else if (d > 0)
+                dist = lattice.colorBucketLow(k, cBuck + d) - yk[3 + k];
+            distUV[k][d + K] = dist*dist;
+        }
+    }
+
+    for (int dBuck1 = -1; dBuck1 <= 1; dBuck1++) {
+        for (int dBuck2 = -1; dBuck2 <= 1; dBuck2++) {
+            if (distXY[0][dBuck1 + 1] + distXY[1][dBuck2 + 1] >= 1)
+                continue;
+            for (int dBuck4 = -K; dBuck4 <= K; dBuck4++) {
+                for (int dBuck5 = -K; dBuck5 <= K; dBuck5++) {
+                    if (distUV[0][dBuck4 + K] + distUV[1][dBuck5 + K] >= 1)
+                        continue;
+                    int from, to;
+                    lattice.neighbourRange(cBuck1 + dBuck1, cBuck2 + dBuck2, cBuck3, cBuck4 + dBuck4, cBuck5 + dBuck5, from, to);
+                    evaluateCandidates<lN, WEIGHT_MAP>(sdims, weights, from, to, yk, lScale, Mh, wsuml, counters);
+                }
+            }
+        }
+    }
+}
+
+// Calculates the mean shift vector Mh at the window location yk using the lattice
+// (equal to LatticeMSVector(Mh, yk) of the NO_SPEEDUP version).
+// If the window is inside of the envelope of the tile - candidates are taken from the tile's compact copy of buckets.
+template <int lN, bool WEIGHT_MAP, typename real_type>
+static inline void computeMSVector(const MeanShiftLattice<real_type> &lattice, const real_type* const* sdims,
+                                   const MeanShiftTileLattice<real_type>* tile, const real_type* const* tileSdims,
+                                   const real_type hiLTr, const real_type* yk, real_type* Mh, FilterCounters &counters)
+{
+    // Initialize mean shift vector
+    for (int j = 0; j < lN; j++)
+        Mh[j] = 0;
+    real_type wsuml = 0;
+
+    // the same range weighting is used for all candidates of this window
+    const real_type lScale = (yk[2] > hiLTr) ? 4 : 1;
+
+    // find bucket of yk
+    int cBuck1, cBuck2, cBuck3;
+    lattice.bucketOf(yk, cBuck1, cBuck2, cBuck3);
+
+    if (lN > 3 && lattice.colorBuckets) {
+        evaluateColorNeighbourBuckets<lN, WEIGHT_MAP>(lattice, cBuck1, cBuck2, cBuck3, sdims, lattice.weights.data(),
+                                      yk, lScale, Mh, wsuml, counters);
+    } else if (tile != nullptr && tile->covers(cBuck1, cBuck2, cBuck3)) {
+        evaluateNeighbourBuckets<lN, WEIGHT_MAP>(*tile, cBuck1, cBuck2, cBuck3, tileSdims, tile->weights.data(),
+                                 yk, lScale, Mh, wsuml, counters);
+    } else {
+        evaluateNeighbourBuckets<lN, WEIGHT_MAP>(lattice, cBuck1, cBuck2, cBuck3, sdims, lattice.weights.data(),
+                                 yk, lScale, Mh, wsuml, counters);
+    }
+
+    if (wsuml > 0) {
+        for (int j = 0; j < lN; j++)
+            Mh[j] = Mh[j]/wsuml - yk[j];
+    } else {
+        for (int j = 0; j < lN; j++)
+            Mh[j] = 0;
+    }
+}
 
 void msImageProcessor::NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
                                                  float* msRawDataRes, std::queue<std::pair<size_t, size_t>>* workQueue, std::mutex* queueLock, std::vector<std::pair<size_t, size_t>>* workProcessed)
 {
+	// runtime dispatch to the filter specialized for number of channels and weight map presence
+	if (N == 3)
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<double, 3, true>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed)
+						 : NewNonOptimizedFilter_omp_impl<double, 3, false>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed);
+	else
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<double, 1, true>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed)
+						 : NewNonOptimizedFilter_omp_impl<double, 1, false>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_float(float sigmaS, float sigmaR,
+                                                       float* msRawDataRes, std::queue<std::pair<size_t, size_t>>* workQueue, std::mutex* queueLock, std::vector<std::pair<size_t, size_t>>* workProcessed)
+{
+	if (N == 3)
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<float, 3, true>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed)
+						 : NewNonOptimizedFilter_omp_impl<float, 3, false>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed);
+	else
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<float, 1, true>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed)
+						 : NewNonOptimizedFilter_omp_impl<float, 1, false>(sigmaS, sigmaR, msRawDataRes, workQueue, queueLock, workProcessed);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_options(float sigmaS, float sigmaR, float* msRawDataRes, const OmpFilterOptions &options)
+{
+	if (N == 3)
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<double, 3, true>(sigmaS, sigmaR, msRawDataRes, nullptr, nullptr, nullptr, options)
+						 : NewNonOptimizedFilter_omp_impl<double, 3, false>(sigmaS, sigmaR, msRawDataRes, nullptr, nullptr, nullptr, options);
+	else
+		weightMapDefined ? NewNonOptimizedFilter_omp_impl<double, 1, true>(sigmaS, sigmaR, msRawDataRes, nullptr, nullptr, nullptr, options)
+						 : NewNonOptimizedFilter_omp_impl<double, 1, false>(sigmaS, sigmaR, msRawDataRes, nullptr, nullptr, nullptr, options);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_tiled(float sigmaS, float sigmaR)
+{
+	OmpFilterOptions options;
+	options.tileSize = std::min(std::max((int) sigmaS, MS_TILE_MIN_SIZE), MS_TILE_MAX_SIZE);
+	NewNonOptimizedFilter_omp_options(sigmaS, sigmaR, nullptr, options);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_5d(float sigmaS, float sigmaR)
+{
+	OmpFilterOptions options;
+	options.colorBuckets = true;
+	NewNonOptimizedFilter_omp_options(sigmaS, sigmaR, nullptr, options);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_binseeded(float sigmaS, float sigmaR)
+{
+	OmpFilterOptions options;
+	options.binSeeds = true;
+	NewNonOptimizedFilter_omp_options(sigmaS, sigmaR, nullptr, options);
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_flat(float sigmaS, float sigmaR)
+{
+	OmpFilterOptions options;
+	options.flatTiles = true;
+	NewNonOptimizedFilter_omp_options(sigmaS, sigmaR, nullptr, options);
+}
+
+// Downsamples LUV data (and weight map if it is not null) 2x by averaging of 2x2 blocks of pixels
+static void downsample2x(const float* data, const float* weightMap, int N, int width, int height,
+						 std::vector<float> &coarseData, std::vector<float> &coarseWeightMap)
+{
+	const int coarseWidth = (width + 1) / 2;
+	const int coarseHeight = (height + 1) / 2;
+	coarseData.assign((size_t) coarseWidth * coarseHeight * N, 0.0f);
+	coarseWeightMap.assign((size_t) coarseWidth * coarseHeight, 0.0f);
+	std::vector<int> coarseCount((size_t) coarseWidth * coarseHeight, 0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const int i = y * width + x;
+			const int c = (y / 2) * coarseWidth + x / 2;
+			for (int j = 0; j < N; j++)
+				coarseData[N * c + j] += data[N * i + j];
+			if (weightMap)
+				coarseWeightMap[c] += weightMap[i];
+			coarseCount[c]++;
+		}
+	}
+	for (size_t c = 0; c < coarseCount.size(); c++) {
+		for (int j = 0; j < N; j++)
+			coarseData[N * c + j] /= coarseCount[c];
+		coarseWeightMap[c] /= coarseCount[c];
+	}
+}
+
+// Defines LUV data of the downsampled level (uniform kernels as msImageProcessor::DefineImage does)
+static bool defineLevel(msImageProcessor &level, std::vector<float> &levelData, const std::vector<float> &levelWeightMap,
+						bool weightMapDefined, int N, int width, int height)
+{
+	level.DefineLInput(levelData.data(), height, width, N);
+	kernelType k[2] = {Uniform, Uniform};
+	int P[2] = {2, N};
+	float tempH[2] = {1.0, 1.0};
+	level.DefineKernel(k, tempH, P, 2);
+	if (weightMapDefined)
+		level.SetLatticeWeightMap(const_cast<float*>(levelWeightMap.data()));
+	return level.ErrorStatus != EL_ERROR;
+}
+
+// Seeds of pixels of the level filtered with sigmaS from modes of the level downsampled 2x (filtered with sigmaS/2):
+// each pixel starts at the mode of its 3x3 coarse neighbourhood that is the closest by range,
+// if this mode is inside of the search window of the pixel (otherwise the pixel starts at itself)
+static void seedsFromCoarseModes(const float* data, int N, int width, int height, float sigmaS, float sigmaR,
+								 std::vector<float> &coarseModes, float* seeds)
+{
+	const int lN = N + 2;
+	const int coarseWidth = (width + 1) / 2;
+	const int coarseHeight = (height + 1) / 2;
+
+	// coarse pixel (x, y) is the center of full resolution pixels (2x+0.5, 2y+0.5)
+	for (size_t c = 0; c < (size_t) coarseWidth * coarseHeight; c++) {
+		coarseModes[lN * c + 0] += 0.5f / sigmaS;
+		coarseModes[lN * c + 1] += 0.5f / sigmaS;
+	}
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int y = 0; y < height; y++) {
+		float point[5];
+		for (int x = 0; x < width; x++) {
+			const int i = y * width + x;
+			point[0] = x / sigmaS;
+			point[1] = y / sigmaS;
+			for (int j = 0; j < N; j++)
+				point[j + 2] = data[N * i + j] / sigmaR;
+
+			const float* best = point;
+			float bestRangeDist = 1.0f;
+			for (int cy = std::max(y / 2 - 1, 0); cy <= std::min(y / 2 + 1, coarseHeight - 1); cy++) {
+				for (int cx = std::max(x / 2 - 1, 0); cx <= std::min(x / 2 + 1, coarseWidth - 1); cx++) {
+					const float* mode = &coarseModes[(size_t) lN * (cy * coarseWidth + cx)];
+					float spatialDist = 0.0f, rangeDist = 0.0f;
+					for (int j = 0; j < 2; j++)
+						spatialDist += (mode[j] - point[j]) * (mode[j] - point[j]);
+					for (int j = 2; j < lN; j++)
+						rangeDist += (mode[j] - point[j]) * (mode[j] - point[j]);
+					if (spatialDist < 1.0f && rangeDist < bestRangeDist) {
+						best = mode;
+						bestRangeDist = rangeDist;
+					}
+				}
+			}
+			for (int j = 0; j < lN; j++)
+				seeds[(size_t) lN * i + j] = best[j];
+		}
+	}
+}
+
+void msImageProcessor::NewNonOptimizedFilter_omp_pyramid(float sigmaS, float sigmaR)
+{
+	const int lN = N + 2;
+	const int coarseWidth = (width + 1) / 2;
+	const int coarseHeight = (height + 1) / 2;
+	const float coarseSigmaS = sigmaS / 2;
+
+	// search window of the coarse level should cover at least a pixel
+	if (coarseSigmaS < 1.0f || width < 2 || height < 2) {
+		NewNonOptimizedFilter_omp(sigmaS, sigmaR);
+		return;
+	}
+
+	std::vector<float> coarseData, coarseWeightMap;
+	downsample2x(data, weightMapDefined ? weightMap : nullptr, N, width, height, coarseData, coarseWeightMap);
+
+	msImageProcessor coarse;
+	if (!defineLevel(coarse, coarseData, coarseWeightMap, weightMapDefined, N, coarseWidth, coarseHeight)) {
+		ErrorHandler("msImageProcessor", "NewNonOptimizedFilter_omp_pyramid", "Failed to define coarse level.");
+		return;
+	}
+	// the coarse level shares the deadline and the progress (it is filtered directly, so the control is not restarted)
+	coarse.SetFilterControl(filterControl);
+	if (filterControl)
+		filterControl->pixelsTotal += (long long) coarseWidth * coarseHeight;
+
+	// filter the coarse level and take its modes
+	std::vector<float> coarseRawData((size_t) coarseWidth * coarseHeight * N);
+	std::vector<float> coarseModes((size_t) coarseWidth * coarseHeight * lN);
+	OmpFilterOptions coarseOptions;
+	coarseOptions.modes = coarseModes.data();
+	coarse.NewNonOptimizedFilter_omp_options(coarseSigmaS, sigmaR, coarseRawData.data(), coarseOptions);
+	if (coarse.ErrorStatus == EL_ERROR) {
+		ErrorHandler("msImageProcessor", "NewNonOptimizedFilter_omp_pyramid", "Failed to filter coarse level.");
+		return;
+	}
+
+	std::vector<float> seeds((size_t) L * lN);
+	seedsFromCoarseModes(data, N, width, height, sigmaS, sigmaR, coarseModes, seeds.data());
+
+	// filter full resolution starting from seeds
+	OmpFilterOptions options;
+	options.seeds = seeds.data();
+	NewNonOptimizedFilter_omp_options(sigmaS, sigmaR, nullptr, options);
+
+	filterStatistics.candidatesExamined += coarse.filterStatistics.candidatesExamined;
+	filterStatistics.candidatesAccepted += coarse.filterStatistics.candidatesAccepted;
+	filterStatistics.iterations += coarse.filterStatistics.iterations;
+	filterStatistics.iterationsLimit = std::min(filterStatistics.iterationsLimit, coarse.filterStatistics.iterationsLimit);
+	// levels are filtered one after another, so their preprocessing times are summed up
+	filterStatistics.preprocessingTime += coarse.filterStatistics.preprocessingTime;
+}
+
+void msImageProcessor::FilterProgressive(float sigmaS, float sigmaR, int levels,
+										 const std::function<void(msImageProcessor &level, int scale)> &onLevel)
+{
+	if(!height)
+	{
+		ErrorHandler("msImageProcessor", "FilterProgressive", "Lattice height and width are undefined.");
+		return;
+	}
+	const int lN = N + 2;
+
+	// LUV data of downsampled levels (level k is downsampled 2^k times)
+	std::vector<std::vector<float>> levelData(1), levelWeightMaps(1);
+	std::vector<int> levelWidths(1, width), levelHeights(1, height);
+	for (int k = 1; k < levels; k++) {
+		const int w = levelWidths[k - 1], h = levelHeights[k - 1];
+		if (sigmaS / (1 << k) < 1.0f || w < 2 || h < 2)
+			break;
+		std::vector<float> coarseData, coarseWeightMap;
+		downsample2x(k == 1 ? data : levelData[k - 1].data(), weightMapDefined ? (k == 1 ? weightMap : levelWeightMaps[k - 1].data()) : nullptr,
+					 N, w, h, coarseData, coarseWeightMap);
+		levelData.push_back(coarseData);
+		levelWeightMaps.push_back(coarseWeightMap);
+		levelWidths.push_back((w + 1) / 2);
+		levelHeights.push_back((h + 1) / 2);
+	}
+
+	// the deadline and progress cover all levels
+	if (filterControl) {
+		long long pixelsTotal = 0;
+		for (size_t k = 0; k < levelData.size(); k++)
+			pixelsTotal += (long long) levelWidths[k] * levelHeights[k];
+		filterControl->Start(pixelsTotal);
+	}
+
+	// modes of the previous (coarser) level
+	std::vector<float> coarseModes;
+	for (int k = (int) levelData.size() - 1; k >= 0; k--) {
+		const int w = levelWidths[k], h = levelHeights[k];
+		const float levelSigmaS = sigmaS / (1 << k);
+
+		msImageProcessor coarse;
+		msImageProcessor &level = (k == 0) ? *this : coarse;
+		if (k > 0 && !defineLevel(coarse, levelData[k], levelWeightMaps[k], weightMapDefined, N, w, h)) {
+			ErrorHandler("msImageProcessor", "FilterProgressive", "Failed to define downsampled level.");
+			return;
+		}
+
+		std::vector<float> seeds;
+		std::vector<float> modes((size_t) w * h * lN);
+		OmpFilterOptions options;
+		options.modes = modes.data();
+		if (!coarseModes.empty()) {
+			seeds.resize((size_t) w * h * lN);
+			seedsFromCoarseModes(k == 0 ? data : levelData[k].data(), N, w, h, levelSigmaS, sigmaR, coarseModes, seeds.data());
+			options.seeds = seeds.data();
+		}
+		level.SetFilterControl(filterControl);
+		level.FilterWithOptions(levelSigmaS, sigmaR, MULTITHREADED_SPEEDUP, &options, false);
+		if (level.ErrorStatus == EL_ERROR) {
+			if (k > 0)
+				ErrorHandler("msImageProcessor", "FilterProgressive", "Failed to filter downsampled level.");
+			return;
+		}
+		coarseModes.swap(modes);
+		onLevel(level, 1 << k);
+	}
+}
+
+template <typename real_type, int CHANNELS, bool WEIGHT_MAP>
+void msImageProcessor::NewNonOptimizedFilter_omp_impl(float sigmaS, float sigmaR,
+                                                      float* msRawDataRes, std::queue<std::pair<size_t, size_t>>* workQueue, std::mutex* queueLock, std::vector<std::pair<size_t, size_t>>* workProcessed,
+                                                      const OmpFilterOptions &options)
+{
+	// number of channels is known at compile time (hides MeanShift::N)
+	const int N = CHANNELS;
+	const int tileSize = options.tileSize;
+
 	std::queue<std::pair<size_t, size_t>> tmpQueue;
 	std::vector<std::pair<size_t, size_t>> tmpWorkProcessed;
 	std::mutex tmpMutex;
 
-	if (msRawDataRes == nullptr && workQueue == nullptr && queueLock == nullptr && workProcessed == nullptr) {
+	if (msRawDataRes == nullptr)
 		msRawDataRes = msRawData;
+	if (workQueue == nullptr && queueLock == nullptr && workProcessed == nullptr) {
 		workQueue = &tmpQueue;
 		queueLock = &tmpMutex;
 		workProcessed = &tmpWorkProcessed;
@@ -33,109 +460,34 @@ void msImageProcessor::NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
 		ErrorHandler("msImageProcessor", "Segment", "sigmaS and/or sigmaR is zero or negative.");
 		return;
 	}
-	
+
 	//define input data dimension with lattice
-	int lN	= N + 2;
-	
+	const int lN	= N + 2;
+
 	// Traverse each data point applying mean shift
 	// to each data point
 
-   // let's use some temporary data
-   real_type* sdata;
-   sdata = new real_type[lN*L];
-
-   // copy the scaled data
-   int idxs, idxd;
-   idxs = idxd = 0;
-   if (N==3)
-   {
-      for(int i=0; i<L; i++)
-      {
-         sdata[idxs++] = (i%width)/sigmaS;
-         sdata[idxs++] = (i/width)/sigmaS;
-         sdata[idxs++] = data[idxd++]/sigmaR;
-         sdata[idxs++] = data[idxd++]/sigmaR;
-         sdata[idxs++] = data[idxd++]/sigmaR;
-      }
-   } else if (N==1)
-   {
-      for(int i=0; i<L; i++)
-      {
-         sdata[idxs++] = (i%width)/sigmaS;
-         sdata[idxs++] = (i/width)/sigmaS;
-         sdata[idxs++] = data[idxd++]/sigmaR;
-      }
-   } else
-   {
-      for(int i=0; i<L; i++)
-      {
-         sdata[idxs++] = (i%width)/sigmaS;
-         sdata[idxs++] = (i%width)/sigmaS;
-         for (int j=0; j<N; j++)
-            sdata[idxs++] = data[idxd++]/sigmaR;
-      }
-   }
    // index the data in the 3d buckets (x, y, L)
-   int* buckets;
-   int* slist;
-   slist = new int[L];
-   int bucNeigh[27];
-
-   real_type sMins; // just for L
-   real_type sMaxs[3]; // for all
-   sMaxs[0] = width/sigmaS;
-   sMaxs[1] = height/sigmaS;
-   sMins = sMaxs[2] = sdata[2];
-   idxs = 2;
-   real_type cval;
-   for(int i=0; i<L; i++)
-   {
-      cval = sdata[idxs];
-      if (cval < sMins)
-         sMins = cval;
-      else if (cval > sMaxs[2])
-         sMaxs[2] = cval;
-
-      idxs += lN;
-   }
-
-   int cBuck1, cBuck2, cBuck3, cBuck;
-   const int nBuck1 = (int) (sMaxs[0] + 3);
-   const int nBuck2 = (int) (sMaxs[1] + 3);
-   const int nBuck3 = (int) (sMaxs[2] - sMins + 3);
-   buckets = new int[nBuck1*nBuck2*nBuck3];
-   for(int i=0; i<(nBuck1*nBuck2*nBuck3); i++)
-      buckets[i] = -1;
-
-   idxs = 0;
-   for(int i=0; i<L; i++)
-   {
-      // find bucket for current data and add it to the list
-      cBuck1 = (int) sdata[idxs] + 1;
-      cBuck2 = (int) sdata[idxs+1] + 1;
-      cBuck3 = (int) (sdata[idxs+2] - sMins) + 1;
-      cBuck = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
-
-      slist[i] = buckets[cBuck];
-      buckets[cBuck] = i;
-
-      idxs += lN;
-   }
-   // init bucNeigh
-   idxd = 0;
-   for (cBuck1=-1; cBuck1<=1; cBuck1++)
-   {
-      for (cBuck2=-1; cBuck2<=1; cBuck2++)
-      {
-         for (cBuck3=-1; cBuck3<=1; cBuck3++)
-         {
-            bucNeigh[idxd++] = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
-         }
-      }
-   }
-   real_type hiLTr = 80.0/sigmaR;
+   performance_timer preprocessingTimer;
+   // (the lattice of the previous call is reused if the input and bandwidths are the same)
+   const std::shared_ptr<const MeanShiftLattice<real_type>> cachedLattice = GetLattice<real_type>(sigmaS, sigmaR, options.colorBuckets);
+   const MeanShiftLattice<real_type> &lattice = *cachedLattice;
+
+   const real_type* sdims[5];
+   for (int k=0; k<lN; k++)
+      sdims[k] = lattice.sdata.data() + k*L;
+
+   real_type hiLTr = (real_type) (80.0/sigmaR);
+
+   // flat pixels are their own modes, almost flat tiles share one window (see ms_flat_regions.h)
+   // (kept between calls as the lattice is)
+   const bool flatPrepass = !WEIGHT_MAP && !options.seeds && !options.binSeeds;
+   const std::shared_ptr<const FlatRegions> cachedFlatRegions = flatPrepass
+      ? GetFlatRegions(sigmaS, sigmaR, options.flatTiles) : std::make_shared<const FlatRegions>();
+   const FlatRegions &flatRegions = *cachedFlatRegions;
+   ReportPreprocessingTime(preprocessingTimer.elapsed());
    // done indexing/hashing
-	
+
 	// proceed ...
 #ifdef PROMPT
 	msSys.Prompt("done.\nApplying mean shift (Using Lattice)... ");
@@ -144,195 +496,67 @@ void msImageProcessor::NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
 #endif
 #endif
 
-	while (true)
+	// ranges of pixels are fetched from the work queue (shared with GPUs in AUTO_SPEEDUP)
+	// and processed by small blocks of pixels on the pool of threads with work stealing
+	auto fetchWork = [&](int &workFrom, int &workTo) -> bool
 	{
-		int workFrom;
-		int workTo;
-		{
-			std::lock_guard<std::mutex> guard(*queueLock);
-			if (workQueue->size() == 0) {
-				break;
-			}
-			auto work = workQueue->front();
-			workFrom = work.first;
-			workTo = work.second;
-			workProcessed->push_back(work);
-			workQueue->pop();
+		std::lock_guard<std::mutex> guard(*queueLock);
+		if (workQueue->size() == 0) {
+			return false;
 		}
-	#pragma omp parallel for schedule(dynamic, 4)
-	for(int i = workFrom; i < workTo; i++)
+		auto work = workQueue->front();
+		workFrom = (int) work.first;
+		workTo = (int) work.second;
+		workProcessed->push_back(work);
+		workQueue->pop();
+		return true;
+	};
+
+	// shifts window yk until convergence (candidates are taken from the tile if it is not null),
+	// the first check of convergence of a window that is not centered at its own point is done in the same way as for shifted windows,
+	// at most limit (> 0) iterations are done
+	auto convergeWindow = [&](real_type* yk, const bool ownPoint, const MeanShiftTileLattice<real_type>* tile, const real_type* const* tileSdims,
+							  FilterCounters &counters, const int limit)
 	{
-		int idxs, idxd;
-		int j, k;
+		int j;
 		int iterationCount;
 
-		int cBuck1, cBuck2, cBuck3, cBuck;
-
-		assert (lN <= 5);
-		real_type yk[5];
 		real_type Mh[5];
 
-		real_type wsuml;
-		real_type mvAbs, diff, el;
-		real_type weight;
+		real_type mvAbs;
 
-		// Assign window center (window centers are
-		// initialized by createLattice to be the point
-		// data[i])
-      idxs = i*lN;
-      for (j=0; j<lN; j++)
-         yk[j] = sdata[idxs+j];
-		
 		// Calculate the mean shift vector using the lattice
-		// LatticeMSVector(Mh, yk);
-      /*****************************************************/
-   	// Initialize mean shift vector
-	   for(j = 0; j < lN; j++)
-   		Mh[j] = 0;
-   	wsuml = 0;
-      // uniformLSearch(Mh, yk_ptr); // modify to new
-      // find bucket of yk
-      cBuck1 = (int) yk[0] + 1;
-      cBuck2 = (int) yk[1] + 1;
-      cBuck3 = (int) (yk[2] - sMins) + 1;
-      cBuck = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
-      for (j=0; j<27; j++)
-      {
-         idxd = buckets[cBuck+bucNeigh[j]];
-         // list parse, crt point is cHeadList
-         while (idxd>=0)
-         {
-            idxs = lN*idxd;
-            // determine if inside search window
-            el = sdata[idxs+0]-yk[0];
-            diff = el*el;
-            el = sdata[idxs+1]-yk[1];
-            diff += el*el;
-
-            if (diff < 1.0)
-            {
-               el = sdata[idxs+2]-yk[2];
-               if (yk[2] > hiLTr)
-                  diff = 4*el*el;
-               else
-                  diff = el*el;
-
-               if (N>1)
-               {
-                  el = sdata[idxs+3]-yk[3];
-                  diff += el*el;
-                  el = sdata[idxs+4]-yk[4];
-                  diff += el*el;
-               }
-
-               if (diff < 1.0)
-               {
-                  weight = 1-weightMap[idxd];
-                  for (k=0; k<lN; k++)
-                     Mh[k] += weight*sdata[idxs+k];
-                  wsuml += weight;
-               }
-            }
-            idxd = slist[idxd];
-         }
-      }
-   	if (wsuml > 0)
-   	{
-		   for(j = 0; j < lN; j++)
-   			Mh[j] = Mh[j]/wsuml - yk[j];
-   	}
-   	else
-   	{
-		   for(j = 0; j < lN; j++)
-   			Mh[j] = 0;
-   	}
-      /*****************************************************/
-		
+		computeMSVector<lN, WEIGHT_MAP>(lattice, sdims, tile, tileSdims, hiLTr, yk, Mh, counters);
+
 		// Calculate its magnitude squared
 		mvAbs = 0;
-		for(j = 0; j < lN; j++)
-			mvAbs += Mh[j]*Mh[j];
-		
+		if (!ownPoint) {
+			mvAbs = (Mh[0]*Mh[0]+Mh[1]*Mh[1])*sigmaS*sigmaS;
+			for(j = 2; j < lN; j++)
+				mvAbs += Mh[j]*Mh[j]*sigmaR*sigmaR;
+		} else {
+			for(j = 0; j < lN; j++)
+				mvAbs += Mh[j]*Mh[j];
+		}
+
 		// Keep shifting window center until the magnitude squared of the
 		// mean shift vector calculated at the window center location is
 		// under a specified threshold (Epsilon)
-		
+
 		// NOTE: iteration count is for speed up purposes only - it
 		//       does not have any theoretical importance
 		iterationCount = 1;
-		while((mvAbs >= EPSILON)&&(iterationCount < LIMIT))
+		while((mvAbs >= EPSILON)&&(iterationCount < limit))
 		{
-			
+
 			// Shift window location
 			for(j = 0; j < lN; j++)
 				yk[j] += Mh[j];
-			
+
 			// Calculate the mean shift vector at the new
 			// window location using lattice
-			// LatticeMSVector(Mh, yk);
-         /*****************************************************/
-         // Initialize mean shift vector
-         for(j = 0; j < lN; j++)
-            Mh[j] = 0;
-         wsuml = 0;
-         // uniformLSearch(Mh, yk_ptr); // modify to new
-         // find bucket of yk
-         cBuck1 = (int) yk[0] + 1;
-         cBuck2 = (int) yk[1] + 1;
-         cBuck3 = (int) (yk[2] - sMins) + 1;
-         cBuck = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
-         for (j=0; j<27; j++)
-         {
-            idxd = buckets[cBuck+bucNeigh[j]];
-            // list parse, crt point is cHeadList
-            while (idxd>=0)
-            {
-               idxs = lN*idxd;
-               // determine if inside search window
-               el = sdata[idxs+0]-yk[0];
-               diff = el*el;
-               el = sdata[idxs+1]-yk[1];
-               diff += el*el;
-               
-               if (diff < 1.0)
-               {
-                  el = sdata[idxs+2]-yk[2];
-                  if (yk[2] > hiLTr)
-                     diff = 4*el*el;
-                  else
-                     diff = el*el;
-                  
-                  if (N>1)
-                  {
-                     el = sdata[idxs+3]-yk[3];
-                     diff += el*el;
-                     el = sdata[idxs+4]-yk[4];
-                     diff += el*el;
-                  }
-                  
-                  if (diff < 1.0)
-                  {
-                     weight = 1-weightMap[idxd];
-                     for (k=0; k<lN; k++)
-                        Mh[k] += weight*sdata[idxs+k];
-                     wsuml += weight;
-                  }
-               }
-               idxd = slist[idxd];
-            }
-         }
-         if (wsuml > 0)
-         {
-            for(j = 0; j < lN; j++)
-               Mh[j] = Mh[j]/wsuml - yk[j];
-         }
-         else
-         {
-            for(j = 0; j < lN; j++)
-               Mh[j] = 0;
-         }
-         /*****************************************************/
-			
+			computeMSVector<lN, WEIGHT_MAP>(lattice, sdims, tile, tileSdims, hiLTr, yk, Mh, counters);
+
 			// Calculate its magnitude squared
 			//mvAbs = 0;
 			//for(j = 0; j < lN; j++)
@@ -350,25 +574,277 @@ void msImageProcessor::NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
 		// Shift window location
 		for(j = 0; j < lN; j++)
 			yk[j] += Mh[j];
-		
+		counters.iterations += iterationCount;
+	};
+
+	// bin-seeded mode discovery: windows are shifted only from centroids of occupied (x, y, L) buckets (bins)
+	// of the lattice, and each pixel takes the mode of the nearest bin seed inside of its own search window
+	std::vector<int> binOfPoint;        // L, bin of each point of the lattice (bins are contiguous in the sorted data)
+	std::vector<int> binEnd;            // end of points of each bin in the sorted data
+	std::vector<real_type> binSeeds;    // lN per bin
+	std::vector<real_type> binModes;    // lN per bin
+	if (options.binSeeds) {
+		binOfPoint.resize(L);
+		int prevBuck1 = -1, prevBuck2 = -1, prevBuck3 = -1;
+		for (int p = 0; p < L; p++) {
+			real_type point[3] = {sdims[0][p], sdims[1][p], sdims[2][p]};
+			int cBuck1, cBuck2, cBuck3;
+			lattice.bucketOf(point, cBuck1, cBuck2, cBuck3);
+			if (p == 0 || cBuck1 != prevBuck1 || cBuck2 != prevBuck2 || cBuck3 != prevBuck3) {
+				if (p > 0)
+					binEnd.push_back(p);
+				binSeeds.resize(binSeeds.size() + lN, 0);
+				prevBuck1 = cBuck1; prevBuck2 = cBuck2; prevBuck3 = cBuck3;
+			}
+			binOfPoint[p] = (int) binEnd.size();
+			for (int k = 0; k < lN; k++)
+				binSeeds[lN*binEnd.size() + k] += sdims[k][p];
+		}
+		binEnd.push_back(L);
+		const int bins = (int) binEnd.size();
+		for (int b = 0; b < bins; b++) {
+			const int count = binEnd[b] - (b == 0 ? 0 : binEnd[b - 1]);
+			for (int k = 0; k < lN; k++)
+				binSeeds[lN*b + k] /= count;
+		}
+
+		// converge seeds of all bins
+		binModes = binSeeds;
+		std::atomic<long long> seedsExamined(0);
+		std::atomic<long long> seedsAccepted(0);
+		std::atomic<long long> seedsIterations(0);
+		bool fetched = false;
+		auto fetchBins = [&](int &workFrom, int &workTo) -> bool
+		{
+			if (fetched)
+				return false;
+			fetched = true;
+			workFrom = 0;
+			workTo = bins;
+			return true;
+		};
+		auto processBins = [&](int binFrom, int binTo)
+		{
+			FilterCounters counters = {0, 0, 0};
+			for (int b = binFrom; b < binTo; b++)
+				convergeWindow(&binModes[lN*b], false, nullptr, nullptr, counters, LIMIT);
+			seedsExamined += counters.examined;
+			seedsAccepted += counters.accepted;
+			seedsIterations += counters.iterations;
+		};
+		WorkStealingPool::instance().run(fetchBins, processBins, MS_WORK_BLOCK_SIZE);
+		filterStatistics.candidatesExamined += seedsExamined;
+		filterStatistics.candidatesAccepted += seedsAccepted;
+		filterStatistics.iterations += seedsIterations;
+	}
+
+	// converge windows of almost flat tiles from their centroids
+	std::vector<real_type> tileModes;   // lN per almost flat tile
+	const int flatTiles = (int) flatRegions.tileCentroids.size()/lN;
+	if (flatTiles > 0) {
+		tileModes.resize((size_t) lN*flatTiles);
+		for (int t = 0; t < flatTiles; t++) {
+			for (int k = 0; k < lN; k++)
+				tileModes[lN*t + k] = (real_type) (flatRegions.tileCentroids[lN*t + k]/(k < 2 ? sigmaS : sigmaR));
+		}
+		std::atomic<long long> tilesExamined(0);
+		std::atomic<long long> tilesAccepted(0);
+		std::atomic<long long> tilesIterations(0);
+		bool fetched = false;
+		auto fetchTiles = [&](int &workFrom, int &workTo) -> bool
+		{
+			if (fetched)
+				return false;
+			fetched = true;
+			workFrom = 0;
+			workTo = flatTiles;
+			return true;
+		};
+		auto processTiles = [&](int tileFrom, int tileTo)
+		{
+			FilterCounters counters = {0, 0, 0};
+			for (int t = tileFrom; t < tileTo; t++)
+				convergeWindow(&tileModes[lN*t], false, nullptr, nullptr, counters, LIMIT);
+			tilesExamined += counters.examined;
+			tilesAccepted += counters.accepted;
+			tilesIterations += counters.iterations;
+		};
+		WorkStealingPool::instance().run(fetchTiles, processTiles, MS_WORK_BLOCK_SIZE);
+		filterStatistics.candidatesExamined += tilesExamined;
+		filterStatistics.candidatesAccepted += tilesAccepted;
+		filterStatistics.iterations += tilesIterations;
+	}
+	// returns the bin which seed is the nearest one to the point inside of the search window centered at it, or -1
+	auto nearestBinSeed = [&](const real_type* point) -> int
+	{
+		int cBuck1, cBuck2, cBuck3;
+		lattice.bucketOf(point, cBuck1, cBuck2, cBuck3);
+		const real_type lScale = (point[2] > hiLTr) ? 4 : 1;
+		int nearest = -1;
+		real_type nearestDist = 0;
+		for (int dBuck1 = -1; dBuck1 <= 1; dBuck1++) {
+			for (int dBuck2 = -1; dBuck2 <= 1; dBuck2++) {
+				int from, to;
+				lattice.neighbourRange(cBuck1 + dBuck1, cBuck2 + dBuck2, cBuck3, from, to);
+				for (int p = from; p < to; p = binEnd[binOfPoint[p]]) {
+					const int b = binOfPoint[p];
+					const real_type* seed = &binSeeds[lN*b];
+					real_type el = seed[0] - point[0];
+					real_type spatialDist = el*el;
+					el = seed[1] - point[1];
+					spatialDist += el*el;
+					el = seed[2] - point[2];
+					real_type rangeDist = lScale*el*el;
+					for (int k = 3; k < lN; k++) {
+						el = seed[k] - point[k];
+						rangeDist += el*el;
+					}
+					if (spatialDist < 1 && rangeDist < 1 && (nearest == -1 || spatialDist + rangeDist < nearestDist)) {
+						nearest = b;
+						nearestDist = spatialDist + rangeDist;
+					}
+				}
+			}
+		}
+		return nearest;
+	};
+
+	// applies mean shift to pixel i (candidates are taken from the tile if it is not null) with at most limit iterations
+	// (0 - the pixel keeps its own color), returns false if the algorithm has been halted
+	auto filterPixel = [&](const int i, const MeanShiftTileLattice<real_type>* tile, const real_type* const* tileSdims,
+						   const int limit, FilterCounters &counters) -> bool
+	{
+		int j;
+		real_type yk[5];
+
+		// Assign window center (window centers are
+		// initialized by createLattice to be the point
+		// data[i], or by the given seed)
+      const int p = lattice.position[i];
+      for (j=0; j<lN; j++)
+         yk[j] = options.seeds ? options.seeds[lN*i+j] : sdims[j][p];
+
+		const int bin = options.binSeeds ? nearestBinSeed(yk) : -1;
+		const int flatTile = flatTiles > 0 ? flatRegions.tileOfPixel[i] : -1;
+		if (bin != -1) {
+			for (j = 0; j < lN; j++)
+				yk[j] = binModes[lN*bin+j];
+		} else if (flatPrepass && flatRegions.flat[i]) {
+			// the mean shift vector of the flat pixel is zero
+		} else if (flatTile != -1) {
+			for (j = 0; j < lN; j++)
+				yk[j] = tileModes[lN*flatTile+j];
+		} else if (limit == 0) {
+			// no time is left (see FilterControl)
+		} else {
+			convergeWindow(yk, !options.seeds, tile, tileSdims, counters, limit);
+		}
+
 		//store result into msRawData...
 		for(j = 0; j < N; j++)
 			msRawDataRes[N*i+j] = (float)(yk[j+2]*sigmaR);
+		if (options.modes) {
+			for(j = 0; j < lN; j++)
+				options.modes[lN*i+j] = (float) yk[j];
+		}
 
 		// Prompt user on progress
 #ifdef SHOW_PROGRESS
 		percent_complete = (float)(i/(float)(L))*100;
 		msSys.Prompt("\r%2d%%", (int)(percent_complete + 0.5));
 #endif
-	
+
 #ifdef MSSYS_PROGRESS
 		// Check to see if the algorithm has been halted
 		if((i%PROGRESS_RATE == 0)&&((ErrorStatus = msSys.Progress((float)(i/(float)(L))*(float)(0.8)))) == EL_HALT)
-			break;
+			return false;
 #endif
+		return true;
+	};
+
+	auto processPixels = [&](int blockFrom, int blockTo, const int limit, FilterCounters &counters)
+	{
+		if (tileSize == 0) {
+			for (int i = blockFrom; i < blockTo; i++)
+				if (!filterPixel(i, nullptr, nullptr, limit, counters))
+					return;
+			return;
+		}
+
+		// pixels of the block are processed by 2d tiles of the grid aligned with the image
+		MeanShiftTileLattice<real_type> tile;
+		const real_type* tileSdims[5];
+		for (int tileY = (blockFrom/width)/tileSize*tileSize; tileY*width < blockTo; tileY += tileSize) {
+			for (int tileX = 0; tileX < width; tileX += tileSize) {
+				const int tileYEnd = std::min(tileY + tileSize, height);
+				const int tileXEnd = std::min(tileX + tileSize, width);
+
+				// find buckets of all pixels of the tile (that are in the block)
+				int min1 = INT_MAX, max1 = INT_MIN, min2 = INT_MAX, max2 = INT_MIN, min3 = INT_MAX, max3 = INT_MIN;
+				for (int y = tileY; y < tileYEnd; y++) {
+					for (int i = std::max(y*width + tileX, blockFrom); i < std::min(y*width + tileXEnd, blockTo); i++) {
+						const int p = lattice.position[i];
+						real_type point[3] = {sdims[0][p], sdims[1][p], sdims[2][p]};
+						int cBuck1, cBuck2, cBuck3;
+						lattice.bucketOf(point, cBuck1, cBuck2, cBuck3);
+						min1 = std::min(min1, cBuck1); max1 = std::max(max1, cBuck1);
+						min2 = std::min(min2, cBuck2); max2 = std::max(max2, cBuck2);
+						min3 = std::min(min3, cBuck3); max3 = std::max(max3, cBuck3);
+					}
+				}
+				if (min1 > max1)
+					continue;
+
+				// envelope of the tile: windows can shift by MS_TILE_MARGIN buckets and need their neighbour buckets
+				const int margin = MS_TILE_MARGIN + 1;
+				tile.gather(lattice, min1 - margin, max1 + margin, min2 - margin, max2 + margin, min3 - margin, max3 + margin);
+				for (int k = 0; k < lN; k++)
+					tileSdims[k] = tile.sdata.data() + k*tile.size;
+
+				for (int y = tileY; y < tileYEnd; y++) {
+					for (int i = std::max(y*width + tileX, blockFrom); i < std::min(y*width + tileXEnd, blockTo); i++) {
+						if (!filterPixel(i, &tile, tileSdims, limit, counters))
+							return;
+					}
+				}
+			}
+		}
+	};
+
+	std::atomic<long long> candidatesExamined(0);
+	std::atomic<long long> candidatesAccepted(0);
+	std::atomic<long long> iterations(0);
+	std::atomic<int> lowestLimit(LIMIT);
+	auto processBlock = [&](int blockFrom, int blockTo)
+	{
+		// with a deadline each block fits the limit of iterations of the remaining pixels to the time left
+		const int limit = filterControl ? filterControl->UpdateIterationsLimit() : LIMIT;
+		for (int lowest = lowestLimit; limit < lowest && !lowestLimit.compare_exchange_weak(lowest, limit); )
+			;
+
+		FilterCounters counters = {0, 0, 0};
+		processPixels(blockFrom, blockTo, limit, counters);
+		candidatesExamined += counters.examined;
+		candidatesAccepted += counters.accepted;
+		iterations += counters.iterations;
+		if (filterControl) {
+			filterControl->iterations += counters.iterations;
+			filterControl->pixelsFiltered += blockTo - blockFrom;
+		}
+	};
+
+	// tiled filter processes bands of tile rows (so each block consists of whole tiles)
+	const int blockSize = (tileSize == 0) ? MS_WORK_BLOCK_SIZE : tileSize*width;
+	filterStatistics.threadsIdleTime = WorkStealingPool::instance().run(fetchWork, processBlock, blockSize);
+	filterStatistics.candidatesExamined += candidatesExamined;
+	filterStatistics.candidatesAccepted += candidatesAccepted;
+	filterStatistics.iterations += iterations;
+	filterStatistics.iterationsLimit = std::min(filterStatistics.iterationsLimit, (int) lowestLimit);
+	if (flatPrepass) {
+		for (auto work : *workProcessed)
+			filterStatistics.flatPixels += std::count(flatRegions.flat.begin() + work.first, flatRegions.flat.begin() + work.second, 1);
 	}
-	}
-	
+
 	// Prompt user that filtering is completed
 #ifdef PROMPT
 #ifdef SHOW_PROGRESS
@@ -376,11 +852,6 @@ void msImageProcessor::NewNonOptimizedFilter_omp(float sigmaS, float sigmaR,
 #endif
 	msSys.Prompt("done.");
 #endif
-	
-	// de-allocate memory
-   delete [] buckets;
-   delete [] slist;
-   delete [] sdata;
 
 	// done.
 	return;
@@ -2,12 +2,76 @@
 
 #include <cl/Engine.h>
 #include "timer.h"
+#include "ms_lattice.h"
+#include "ms_flat_regions.h"
 
 #include "ms_filter_opencl_kernel_cl.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Workgroups of the persistent threads kernel per compute unit (enough to keep the device busy while it runs only these groups)
+#ifndef MS_OPENCL_PERSISTENT_GROUPS_PER_COMPUTE_UNIT
+#define MS_OPENCL_PERSISTENT_GROUPS_PER_COMPUTE_UNIT 8
+#endif
+
+// Pairs of bandwidths {sigmaS, sigmaR} that get their own program with the bandwidths compiled in as constants,
+// e.g. -DMS_OPENCL_HOT_BANDWIDTHS="{8.0f, 5.0f}, {16.0f, 8.0f}". Other bandwidths are passed as kernel arguments
+// of the generic program, so a sweep over them compiles the kernel once.
+#ifndef MS_OPENCL_HOT_BANDWIDTHS
+#define MS_OPENCL_HOT_BANDWIDTHS
+#endif
+
+// OpenCL C literal of the float (9 significant digits restore it exactly, so the constant is equal to the kernel argument)
+static std::string floatLiteral(float value)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.9ef", (double) value);
+    return buffer;
+}
+
+// Best GPU (or CPU if there are no GPUs) with its workgroup size, chosen on the first call of the process.
+// Set EDISON_GPU_OPENCL_DEVICE environment variable to cpu to use CPU device even if there are GPUs (e.g. to benchmark kernels).
+struct DefaultDevice {
+    cl::Device_ptr device;
+    int workgroupSize;
+};
+
+static const DefaultDevice &defaultDevice()
+{
+    static const DefaultDevice chosen = []() -> DefaultDevice {
+        if (!cl::initOpenCL()) {
+            throw std::runtime_error("OpenCL initialization failed!");
+        }
+
+        const char* requested = std::getenv("EDISON_GPU_OPENCL_DEVICE");
+        const bool cpuRequested = requested != nullptr && std::strcmp(requested, "cpu") == 0;
+        DefaultDevice result{cpuRequested ? cl::Device_ptr() : cl::getGPUDevice(), 128};
+        if (!result.device) {
+            result.device = cl::getCPUDevice();
+            if (!result.device) {
+                throw std::runtime_error("No OpenCL devices!");
+            }
+            verbose_cout << "Using platform: " << result.device->platform->name << std::endl;
+            result.workgroupSize = std::max(32, (int) result.device->max_compute_units * 4);
+        }
+        verbose_cout << "Using device: " << result.device->name << " with " << result.device->max_compute_units
+                     << " max compute units" << std::endl;
+        return result;
+    }();
+    return chosen;
+}
+
+// Slots of buffers of the filter in the pool of the shared engine of the device
+enum GpuFilterBuffer {
+    BUFFER_SDATA, BUFFER_BUCKET_START, BUFFER_HASH_SLOTS, BUFFER_WEIGHTS, BUFFER_POSITION, BUFFER_FLAT, BUFFER_MS_RAW_DATA,
+    BUFFER_NEXT_PIXEL
+};
+
 void msImageProcessor::NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
                                                  float* msRawDataRes, std::queue<std::pair<size_t, size_t>>* workQueue, std::mutex* queueLock, std::vector<std::pair<size_t, size_t>>* workProcessed,
-                                                 cl::Device_ptr device)
+                                                 cl::Device_ptr device, bool persistentThreads)
 {
     int WORKGROUP_SIZE = 128;
 
@@ -22,21 +86,8 @@ void msImageProcessor::NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
         workProcessed = &tmpWorkProcessed;
         tmpQueue.push(std::pair<int, int>(0, L));
 
-        if (!cl::initOpenCL()) {
-            throw std::runtime_error("OpenCL initialization failed!");
-        }
-
-        device = cl::getGPUDevice();
-        if (!device) {
-            device = cl::getCPUDevice();
-            if (!device) {
-                throw std::runtime_error("No OpenCL devices!");
-            }
-            verbose_cout << "Using platform: " << device->platform->name << std::endl;
-            WORKGROUP_SIZE = std::max(32, (int) device->max_compute_units * 4);
-        }
-        verbose_cout << "Using device: " << device->name << " with " << device->max_compute_units
-                     << " max compute units" << std::endl;
+        device = defaultDevice().device;
+        WORKGROUP_SIZE = defaultDevice().workgroupSize;
     }
 
     //make sure that a lattice height and width have
@@ -55,133 +106,110 @@ void msImageProcessor::NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
     //define input data dimension with lattice
     int lN = N + 2;
 
-    // Traverse each data point applying mean shift
-    // to each data point
-
-    // let's use some temporary data
-    float *sdata;
-    std::vector<float> sdata_data(lN * L);
-    sdata = sdata_data.data();
-
-    // copy the scaled data
-    int idxs, idxd;
-    idxs = idxd = 0;
-    if (N == 3) {
-        for (int i = 0; i < L; i++) {
-            sdata[idxs++] = (i % width) / sigmaS;
-            sdata[idxs++] = (i / width) / sigmaS;
-            sdata[idxs++] = data[idxd++] / sigmaR;
-            sdata[idxs++] = data[idxd++] / sigmaR;
-            sdata[idxs++] = data[idxd++] / sigmaR;
-        }
-    } else if (N == 1) {
-        for (int i = 0; i < L; i++) {
-            sdata[idxs++] = (i % width) / sigmaS;
-            sdata[idxs++] = (i / width) / sigmaS;
-            sdata[idxs++] = data[idxd++] / sigmaR;
-        }
-    } else {
-        for (int i = 0; i < L; i++) {
-            sdata[idxs++] = (i % width) / sigmaS;
-            sdata[idxs++] = (i % width) / sigmaS;
-            for (int j = 0; j < N; j++)
-                sdata[idxs++] = data[idxd++] / sigmaR;
-        }
-    }
     // index the data in the 3d buckets (x, y, L)
-    int *buckets;
-    int *slist;
-    std::vector<int> slist_data(L);
-    slist = slist_data.data();
-
-    float sMins; // just for L
-    float sMaxs[3]; // for all
-    sMaxs[0] = width / sigmaS;
-    sMaxs[1] = height / sigmaS;
-    sMins = sMaxs[2] = sdata[2];
-    idxs = 2;
-    float cval;
-    for (int i = 0; i < L; i++) {
-        cval = sdata[idxs];
-        if (cval < sMins)
-            sMins = cval;
-        else if (cval > sMaxs[2])
-            sMaxs[2] = cval;
-
-        idxs += lN;
-    }
-
-    int cBuck1, cBuck2, cBuck3, cBuck;
-    const int nBuck1 = (int) (sMaxs[0] + 3);
-    const int nBuck2 = (int) (sMaxs[1] + 3);
-    const int nBuck3 = (int) (sMaxs[2] - sMins + 3);
-    std::vector<int> buckets_data(nBuck1 * nBuck2 * nBuck3);
-    buckets = buckets_data.data();
-    for (int i = 0; i < (nBuck1 * nBuck2 * nBuck3); i++)
-        buckets[i] = -1;
-
-    idxs = 0;
-    for (int i = 0; i < L; i++) {
-        // find bucket for current data and add it to the list
-        cBuck1 = (int) sdata[idxs] + 1;
-        cBuck2 = (int) sdata[idxs + 1] + 1;
-        cBuck3 = (int) (sdata[idxs + 2] - sMins) + 1;
-        cBuck = cBuck1 + nBuck1 * (cBuck2 + nBuck2 * cBuck3);
-
-        slist[i] = buckets[cBuck];
-        buckets[cBuck] = i;
-
-        idxs += lN;
-    }
+    performance_timer preprocessingTimer;
+    // (the lattice of the previous call is reused if the input and bandwidths are the same)
+    const std::shared_ptr<const MeanShiftLattice<float>> cachedLattice = GetLattice<float>(sigmaS, sigmaR);
+    const MeanShiftLattice<float> &lattice = *cachedLattice;
+    ReportPreprocessingTime(preprocessingTimer.elapsed());
+    const int nBuck1 = lattice.nBuck1;
+    const int nBuck2 = lattice.nBuck2;
+    const int nBuck3 = lattice.nBuck3;
+    const int hashMask = lattice.sparse ? lattice.hashMask : 0;
+    // dense grid of buckets or slots of the hash table of the sparse lattice (unused one is a dummy buffer)
+    typedef MeanShiftLattice<float>::HashSlot HashSlot;
+    const std::vector<int>      bucketStartDummy(1, 0);
+    const std::vector<HashSlot> hashSlotsDummy(1, HashSlot{-1, 0, 0, 0, 0});
+    const std::vector<int>      &bucketStart = lattice.sparse ? bucketStartDummy : lattice.bucketStart;
+    const std::vector<HashSlot> &hashSlots   = lattice.sparse ? lattice.hashSlots : hashSlotsDummy;
+    if (lattice.sparse)
+        verbose_cout << "Sparse lattice with " << (hashMask + 1) << " slots is used" << std::endl;
+    // flat pixels are their own modes (see ms_flat_regions.h), the kernel writes them without scanning of the lattice
+    // (kept between calls as the lattice is)
+    std::shared_ptr<const FlatRegions> cachedFlatRegions;
+    if (!weightMapDefined)
+        cachedFlatRegions = GetFlatRegions(sigmaS, sigmaR, false);
+    const std::vector<cl_uchar> noFlatPixels(cachedFlatRegions ? 0 : L, 0);
+    const cl_uchar* flat = cachedFlatRegions ? cachedFlatRegions->flat.data() : noFlatPixels.data();
     // done indexing/hashing
 
-    cl::Engine_ptr engine(new cl::Engine(device));
-    engine->init();
+    // the engine, compiled kernels and buffers of the device are kept between calls (buffers grow to the largest image),
+    // calls on the same device from other threads wait until this one is done with them
+    cl::SharedEngine_ptr sharedEngine = cl::getSharedEngine(device);
+    if (!sharedEngine)
+        throw std::runtime_error("OpenCL engine initialization failed!");
+    std::lock_guard<std::mutex> deviceGuard(sharedEngine->lock);
+    const cl::Engine_ptr engine = sharedEngine->engine;
 
     cl::Kernel_ptr kernel;
 
     {
+        // bandwidths, weight map and lattice layout are kernel arguments, so the program depends only on N and the device
         std::string defines = std::string("")
                               + " -D WORKGROUP_SIZE=" + std::to_string(WORKGROUP_SIZE)
                               + " -D WAVEFRONT_SIZE=" + std::to_string(engine->device->wavefront_size)
                               + " -D N=" + std::to_string(N)
                               + " -D EPSILON=" + std::to_string(EPSILON) + "f"
                               + " -D LIMIT=" + std::to_string(LIMIT)
-                              + " -D sigmaS=" + std::to_string(sigmaS) + "f"
-                              + " -D sigmaR=" + std::to_string(sigmaR) + "f"
         ;
+        const std::vector<std::pair<float, float>> hotBandwidths = { MS_OPENCL_HOT_BANDWIDTHS };
+        for (const std::pair<float, float> &bandwidths : hotBandwidths) {
+            if (bandwidths.first == sigmaS && bandwidths.second == sigmaR) {
+                defines += " -D HOT_SIGMA_S=" + floatLiteral(sigmaS) + " -D HOT_SIGMA_R=" + floatLiteral(sigmaR);
+                break;
+            }
+        }
         performance_timer timer;
-        kernel = engine->compileKernel(mean_shift_kernel, mean_shift_kernel_length, "meanShiftFilter", defines.data());
+        kernel = sharedEngine->kernel(mean_shift_kernel, mean_shift_kernel_length,
+                                      persistentThreads ? "meanShiftFilterPersistent" : "meanShiftFilter", defines.data());
         if (!kernel)
             throw std::runtime_error("OpenCL kernel compilation failed!");
-        verbose_cout << "Kernel compiled in " << timer.elapsed() << " s!" << std::endl;
+        verbose_cout << "Kernel ready in " << timer.elapsed() << " s!" << std::endl;
     }
 
-    cl_mem buf_sdata        = engine->createBuffer(lN * L * sizeof(cl_float),                 CL_MEM_READ_ONLY);  cl::BufferGuard buf_sdata_guard    (buf_sdata,     engine);
-    cl_mem buf_buckets      = engine->createBuffer(nBuck1 * nBuck2 * nBuck3 * sizeof(cl_int), CL_MEM_READ_ONLY);  cl::BufferGuard buf_buckets_guard  (buf_buckets,   engine);
-    cl_mem buf_weightMap    = engine->createBuffer(L * sizeof(cl_float),                      CL_MEM_READ_ONLY);  cl::BufferGuard buf_weightMap_guard(buf_weightMap, engine);
-    cl_mem buf_slist        = engine->createBuffer(L * sizeof(cl_int),                        CL_MEM_READ_ONLY);  cl::BufferGuard buf_slist_guard    (buf_slist,     engine);
-    cl_mem buf_msRawData    = engine->createBuffer(N * L * sizeof(cl_float),                  CL_MEM_WRITE_ONLY); cl::BufferGuard buf_msRawData_guard(buf_msRawData, engine);
-
-    engine->writeBuffer(buf_sdata,     lN * L * sizeof(cl_float),                 sdata);
-    engine->writeBuffer(buf_buckets,   nBuck1 * nBuck2 * nBuck3 * sizeof(cl_int), buckets);
-    engine->writeBuffer(buf_weightMap, L * sizeof(cl_float),                      weightMap);
-    engine->writeBuffer(buf_slist,     L * sizeof(cl_int),                        slist);
+    cl::BufferPool &buffers = sharedEngine->buffers;
+    cl_mem buf_sdata        = buffers.get(BUFFER_SDATA,        lN * L * sizeof(cl_float),           CL_MEM_READ_ONLY);
+    cl_mem buf_bucketStart  = buffers.get(BUFFER_BUCKET_START, bucketStart.size() * sizeof(cl_int), CL_MEM_READ_ONLY);
+    cl_mem buf_hashSlots    = buffers.get(BUFFER_HASH_SLOTS,   hashSlots.size() * sizeof(HashSlot), CL_MEM_READ_ONLY);
+    cl_mem buf_weights      = buffers.get(BUFFER_WEIGHTS,      L * sizeof(cl_float),                CL_MEM_READ_ONLY);
+    cl_mem buf_position     = buffers.get(BUFFER_POSITION,     L * sizeof(cl_int),                  CL_MEM_READ_ONLY);
+    cl_mem buf_flat         = buffers.get(BUFFER_FLAT,         L * sizeof(cl_uchar),                CL_MEM_READ_ONLY);
+    cl_mem buf_msRawData    = buffers.get(BUFFER_MS_RAW_DATA,  N * L * sizeof(cl_float),            CL_MEM_WRITE_ONLY);
+    cl_mem buf_nextPixel    = buffers.get(BUFFER_NEXT_PIXEL,   sizeof(cl_int),                      CL_MEM_READ_WRITE);
+
+    engine->writeBuffer(buf_sdata,       lN * L * sizeof(cl_float),       lattice.sdata.data());
+    engine->writeBuffer(buf_bucketStart, bucketStart.size() * sizeof(cl_int), bucketStart.data());
+    engine->writeBuffer(buf_hashSlots,   hashSlots.size() * sizeof(HashSlot), hashSlots.data());
+    engine->writeBuffer(buf_weights,     L * sizeof(cl_float),            lattice.weights.data());
+    engine->writeBuffer(buf_position,    L * sizeof(cl_int),              lattice.position.data());
+    engine->writeBuffer(buf_flat,        L * sizeof(cl_uchar),            flat);
 
     {
         unsigned int i = 0;
         kernel->setArg(i++, sizeof(cl_mem), &buf_sdata);
-        kernel->setArg(i++, sizeof(cl_mem), &buf_buckets);
-        kernel->setArg(i++, sizeof(cl_mem), &buf_weightMap);
-        kernel->setArg(i++, sizeof(cl_mem), &buf_slist);
+        kernel->setArg(i++, sizeof(cl_mem), &buf_bucketStart);
+        kernel->setArg(i++, sizeof(cl_mem), &buf_hashSlots);
+        kernel->setArg(i++, sizeof(cl_mem), &buf_weights);
+        kernel->setArg(i++, sizeof(cl_mem), &buf_position);
+        kernel->setArg(i++, sizeof(cl_mem), &buf_flat);
         kernel->setArg(i++, sizeof(cl_mem), &buf_msRawData);
         kernel->setArg(i++, sizeof(int),    &L);
         kernel->setArg(i++, sizeof(int),    &width);
         kernel->setArg(i++, sizeof(int),    &height);
-        kernel->setArg(i++, sizeof(float),  &sMins);
+        kernel->setArg(i++, sizeof(float),  &lattice.sMins);
         kernel->setArg(i++, sizeof(int),    &nBuck1);
         kernel->setArg(i++, sizeof(int),    &nBuck2);
         kernel->setArg(i++, sizeof(int),    &nBuck3);
+        const int sparseLattice = lattice.sparse ? 1 : 0;
+        const int weightMap = weightMapDefined ? 1 : 0;
+        kernel->setArg(i++, sizeof(int),    &sparseLattice);
+        kernel->setArg(i++, sizeof(int),    &hashMask);
+        kernel->setArg(i++, sizeof(int),    &weightMap);
+        kernel->setArg(i++, sizeof(float),  &sigmaS);
+        kernel->setArg(i++, sizeof(float),  &sigmaR);
+        const unsigned int nextPixelArg = i;
+        if (persistentThreads)
+            kernel->setArg(i++, sizeof(cl_mem), &buf_nextPixel);
 
         size_t localWorkSize[3];
         size_t globalWorkOffset[3];
@@ -195,6 +223,7 @@ void msImageProcessor::NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
         performance_timer timer;
 
         int limit = 64 * 1024;
+        const int persistentGroups = std::max(1, (int) device->max_compute_units * MS_OPENCL_PERSISTENT_GROUPS_PER_COMPUTE_UNIT);
 
         cl_event event_prev_launch = NULL;
 
@@ -213,19 +242,37 @@ void msImageProcessor::NewNonOptimizedFilter_gpu(float sigmaS, float sigmaR,
                 workProcessed->push_back(work);
                 workQueue->pop();
             }
-            for (int offset = workFrom; offset < workTo; offset += limit) {
-                globalWorkOffset[0] = offset;
-                globalWorkOffset[1] = 0;
-                globalWorkSize[0] = std::min(L - offset, limit);
-                globalWorkSize[1] = WORKGROUP_SIZE;
-
-                cl_event event_cur_launch = NULL;
-                engine->enqueueKernel(kernel, 2, globalWorkSize, localWorkSize, globalWorkOffset, &event_cur_launch);
-                if (event_prev_launch != NULL) {
-                    engine->waitForEvents(1, &event_prev_launch);
+            // pixels taken by the device are not left to CPU share of AUTO_SPEEDUP (see FilterControl)
+            if (filterControl)
+                filterControl->pixelsFiltered += workTo - workFrom;
+            if (persistentThreads) {
+                for (int offset = workFrom; offset < workTo; offset += limit) {
+                    // groups take pixels [offset, pixelsTo) from the counter, the blocking write waits for the previous launch
+                    const int pixelsTo = std::min(std::min(L, workTo), offset + limit);
+                    engine->writeBuffer(buf_nextPixel, sizeof(cl_int), &offset);
+                    kernel->setArg(nextPixelArg + 1, sizeof(int), &pixelsTo);
+
+                    globalWorkOffset[0] = 0;
+                    globalWorkOffset[1] = 0;
+                    globalWorkSize[0] = std::min(pixelsTo - offset, persistentGroups);
+                    globalWorkSize[1] = WORKGROUP_SIZE;
+                    engine->enqueueKernel(kernel, 2, globalWorkSize, localWorkSize, globalWorkOffset);
+                }
+            } else {
+                for (int offset = workFrom; offset < workTo; offset += limit) {
+                    globalWorkOffset[0] = offset;
+                    globalWorkOffset[1] = 0;
+                    globalWorkSize[0] = std::min(L - offset, limit);
+                    globalWorkSize[1] = WORKGROUP_SIZE;
+
+                    cl_event event_cur_launch = NULL;
+                    engine->enqueueKernel(kernel, 2, globalWorkSize, localWorkSize, globalWorkOffset, &event_cur_launch);
+                    if (event_prev_launch != NULL) {
+                        engine->waitForEvents(1, &event_prev_launch);
+                    }
+
+                    event_prev_launch = event_cur_launch;
                 }
-
-                event_prev_launch = event_cur_launch;
             }
         }
         engine->finish();
@@ -8,16 +8,11 @@
     #define N       3
     #define EPSILON 0.01f
     #define LIMIT   100
-    #define sigmaS  8.0f
-    #define sigmaR  5.0f
 #endif
 
 #define lN (N + 2)
 
 #define MAX_NEIGHBOURS 27
-#define MAX_SAMPLES    64
-#define IDXDS_MAX      (MAX_NEIGHBOURS * MAX_SAMPLES)
-#define IDXDS_EMPTY    INT_MAX
 
 #if 0
 #define assert(expression) if (!(expression)) printf("Assertion failed at line %d!", __LINE__);
@@ -25,35 +20,76 @@
 #define assert(expression) 
 #endif
 
-inline int getBucNeigh(const int j, const int nBuck1, const int nBuck2)
+// Buckets are sorted with L as the fastest dimension (see MeanShiftLattice::bucketIndex)
+inline int getBucketIndex(const int cBuck1, const int cBuck2, const int cBuck3, const int nBuck2, const int nBuck3)
 {
-    return ((j / 9) % 3 - 1) + nBuck1 * (((j / 3) % 3 - 1) + nBuck2 * (j % 3 - 1));
-// Equal to:
-//    idxd = 0;
-//    for (cBuck1=-1; cBuck1<=1; cBuck1++)
-//        for (cBuck2=-1; cBuck2<=1; cBuck2++)
-//            for (cBuck3=-1; cBuck3<=1; cBuck3++)
-//                bucNeigh[idxd++] = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
-//    return bucNeigh[j];
+    return cBuck3 + nBuck3 * (cBuck2 + nBuck2 * cBuck1);
 }
 
-__attribute__((reqd_work_group_size(1, WORKGROUP_SIZE, 1)))
-__kernel void meanShiftFilter(__global const float* sdata,     // lN*L
-                              __global const int*   buckets,   // nBuck1*nBuck2*nBuck3
-                              __global const float* weightMap, // L
-                              __global const int*   slist,     // L
-                              __global       float* msRawData, // N*L
-                              const int L,
-                              const int width, const int height,
-                              const float sMins,
-                              const int nBuck1, const int nBuck2, const int nBuck3
+// Slot of the hash table of the sparse lattice (see MeanShiftLattice::HashSlot)
+typedef struct {
+    long key;                           // -1 if the slot is empty
+    int bucketFrom, bucketTo;
+    int neighboursFrom, neighboursTo;
+} HashSlot;
+
+// Returns range [*from, *to) of points of the bucket (see MeanShiftLattice::bucketRange)
+inline void getBucketRange(__global const int* bucketStart, __global const HashSlot* hashSlots, const int sparseLattice, const int hashMask,
+                           const int cBuck1, const int cBuck2, const int cBuck3, const int nBuck2, const int nBuck3,
+                           int* from, int* to)
+{
+    if (sparseLattice) {
+        // open addressing hash table with linear probing
+        const long key = cBuck3 + (long) nBuck3 * (cBuck2 + (long) nBuck2 * cBuck1);
+        uint slot = ((uint) (((ulong) key * 0x9E3779B97F4A7C15UL) >> 32)) & hashMask;
+        while (hashSlots[slot].key != key && hashSlots[slot].key != -1)
+            slot = (slot + 1) & hashMask;
+        if (hashSlots[slot].key == -1) {
+            *from = 0;
+            *to = 0;
+        } else {
+            *from = hashSlots[slot].bucketFrom;
+            *to = hashSlots[slot].bucketTo;
+        }
+    } else {
+        const int b = getBucketIndex(cBuck1, cBuck2, cBuck3, nBuck2, nBuck3);
+        *from = bucketStart[b];
+        *to = bucketStart[b + 1];
+    }
+}
+
+// Mean shift of the window of i-th pixel until convergence, calculated by the whole workgroup
+// (cache, bucketFroms and candidateOffsets are local buffers of the workgroup, see meanShiftFilter)
+inline void meanShiftPixel(const int i,
+                           __global const float* sdata,       // lN*L, points sorted by bucket, k-th dimension of point p is sdata[k*L + p]
+                           __global const int*   bucketStart, // nBuck1*nBuck2*nBuck3+1, points of bucket b are [bucketStart[b], bucketStart[b+1])
+                           __global const HashSlot* hashSlots, // hashMask+1, slots of the hash table (if sparseLattice instead of bucketStart)
+                           __global const float* weights,     // L, sorted by bucket, 1-weightMap (if weightMap)
+                           __global const int*   position,    // L, position of i-th pixel in sorted data
+                           __global const uchar* flat,        // L, 1 if i-th pixel is flat (it is its own mode, see ms_flat_regions.h)
+                           __global       float* msRawData,   // N*L
+                           const int L,
+                           const int width, const int height,
+                           const float sMins,
+                           const int nBuck1, const int nBuck2, const int nBuck3,
+                           const int sparseLattice, const int hashMask,
+                           const int weightMap,
+                           const float sigmaSArg, const float sigmaRArg,
+                           __local float* cache,       // WORKGROUP_SIZE*(lN+1), partial sums of threads
+                           __local int*   bucketFroms, // MAX_NEIGHBOURS, first points of neighbour buckets
+                           __local int*   candidateOffsets // MAX_NEIGHBOURS+1, offsets of points of buckets in the list of candidates
 )
 {
-    __local int    idxds[IDXDS_MAX];
-    __local float* cache = (__local float*) idxds;
-    assert (WORKGROUP_SIZE * (lN + 1) <= IDXDS_MAX);
+    // bandwidths are arguments, so that one program serves all of them, unless the program is specialized for hot values
+    // (HOT_SIGMA_S and HOT_SIGMA_R are defined equal to the arguments, see MS_OPENCL_HOT_BANDWIDTHS)
+#ifdef HOT_SIGMA_S
+    const float sigmaS = HOT_SIGMA_S;
+    const float sigmaR = HOT_SIGMA_R;
+#else
+    const float sigmaS = sigmaSArg;
+    const float sigmaR = sigmaRArg;
+#endif
 
-    const int i = get_global_id(0);
     const int threadY = get_local_id(1);
     const int thread0 = 0;
 
@@ -66,8 +102,18 @@ __kernel void meanShiftFilter(__global const float* sdata,     // lN*L
     // Assign window center (window centers are
     // initialized by createLattice to be the point
     // data[i])
+    const int p = position[i];
     for (int j = 0; j < lN; j++)
-        yk[j] = sdata[i * lN + j];
+        yk[j] = sdata[j * L + p];
+
+    // the whole workgroup processes the same pixel, so it leaves before barriers together
+    if (flat[i]) {
+        if (threadY < N) {
+            int j = threadY;
+            msRawData[N * i + j] = (float) (yk[j + 2] * sigmaR);
+        }
+        return;
+    }
 
     // Calculate the mean shift vector using the lattice
     // LatticeMSVector(Mh, yk);
@@ -76,65 +122,63 @@ __kernel void meanShiftFilter(__global const float* sdata,     // lN*L
     for (int k = 0; k < lN; ++k)
         Mh[k] = 0.0f;
     wsuml = 0.0f;
+    // the same range weighting is used for all candidates of this window
+    const float lScale = (yk[2] > hiLTr) ? 4.0f : 1.0f;
 
     if (threadY < MAX_NEIGHBOURS) {
         int j = threadY;
-        int cBuck;
+        int idxd, idxdEnd;
         {
             int cBuck1 = (int) yk[0] + 1;
             int cBuck2 = (int) yk[1] + 1;
             int cBuck3 = (int) (yk[2] - sMins) + 1;
-            cBuck = cBuck1 + nBuck1 * (cBuck2 + nBuck2 * cBuck3);
-        }
-        int bucketId = cBuck + getBucNeigh(j, nBuck1, nBuck2);
-        int idxd = buckets[bucketId];
-        // list parse, crt point is cHeadList
-        int k = 0;
-        for (; k < MAX_SAMPLES && idxd >= 0; ++k) {
-            idxds[j * MAX_SAMPLES + k] = idxd;
-            idxd = slist[idxd];
+            // j-th of 27 neighbour buckets
+            getBucketRange(bucketStart, hashSlots, sparseLattice, hashMask, cBuck1 + (j / 9) % 3 - 1, cBuck2 + (j / 3) % 3 - 1, cBuck3 + j % 3 - 1,
+                           nBuck2, nBuck3, &idxd, &idxdEnd);
         }
-        for (; k < MAX_SAMPLES; ++k) {
-            idxds[j * MAX_SAMPLES + k] = IDXDS_EMPTY;
-        }
-        assert(idxd < 0);
+        bucketFroms[j] = idxd;
+        candidateOffsets[j + 1] = idxdEnd - idxd;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (threadY == 0) {
+        candidateOffsets[0] = 0;
+        for (int j = 0; j < MAX_NEIGHBOURS; j++)
+            candidateOffsets[j + 1] += candidateOffsets[j];
     }
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for (int j = threadY; j < IDXDS_MAX; j += WORKGROUP_SIZE) {
-        int idxd = idxds[j];
-        if (idxd != IDXDS_EMPTY) {
-            int idxs = lN * idxd;
-            // determine if inside search window
-
-            float el, diff;
-            el = sdata[idxs + 0] - yk[0];
-            diff = el * el;
-            el = sdata[idxs + 1] - yk[1];
-            diff += el * el;
-
-            if (diff < 1.0f) {
-                el = sdata[idxs + 2] - yk[2];
-                if (yk[2] > hiLTr)
-                    diff = 4.0f * el * el;
-                else
-                    diff = el * el;
+    // all points of the buckets are candidates (however many of them there are), each thread takes every WORKGROUP_SIZE-th one
+    const int candidatesNumber = candidateOffsets[MAX_NEIGHBOURS];
+    int bucket = 0;
+    for (int c = threadY; c < candidatesNumber; c += WORKGROUP_SIZE) {
+        while (c >= candidateOffsets[bucket + 1])
+            ++bucket;
+        const int idxd = bucketFroms[bucket] + (c - candidateOffsets[bucket]);
+        // determine if inside search window
+        float el, diff;
+        el = sdata[idxd] - yk[0];
+        diff = el * el;
+        el = sdata[L + idxd] - yk[1];
+        diff += el * el;
+
+        if (diff < 1.0f) {
+            el = sdata[2 * L + idxd] - yk[2];
+            diff = lScale * el * el;
 
 #if (N == 3)
-                {
-                    el = sdata[idxs + 3] - yk[3];
-                    diff += el * el;
-                    el = sdata[idxs + 4] - yk[4];
-                    diff += el * el;
-                }
+            {
+                el = sdata[3 * L + idxd] - yk[3];
+                diff += el * el;
+                el = sdata[4 * L + idxd] - yk[4];
+                diff += el * el;
+            }
 #endif
 
-                if (diff < 1.0f) {
-                    float weight = 1.0f - weightMap[idxd];
-                    for (int k = 0; k < lN; ++k)
-                        Mh[k] += weight * sdata[idxs + k];
-                    wsuml += weight;
-                }
+            if (diff < 1.0f) {
+                float weight = weightMap ? weights[idxd] : 1.0f;
+                for (int k = 0; k < lN; ++k)
+                    Mh[k] += weight * sdata[k * L + idxd];
+                wsuml += weight;
             }
         }
     }
@@ -202,67 +246,63 @@ __kernel void meanShiftFilter(__global const float* sdata,     // lN*L
         for (int j = 0; j < lN; j++)
             Mh[j] = 0.0f;
         wsuml = 0.0f;
+        // the same range weighting is used for all candidates of this window
+        const float lScale = (yk[2] > hiLTr) ? 4.0f : 1.0f;
 
         if (threadY < MAX_NEIGHBOURS) {
             int j = threadY;
-            int cBuck;
+            int idxd, idxdEnd;
             {
                 int cBuck1 = (int) yk[0] + 1;
                 int cBuck2 = (int) yk[1] + 1;
                 int cBuck3 = (int) (yk[2] - sMins) + 1;
-                cBuck = cBuck1 + nBuck1 * (cBuck2 + nBuck2 * cBuck3);
-            }
-            int bucketId = cBuck + getBucNeigh(j, nBuck1, nBuck2);
-            int idxd = buckets[bucketId];
-            // list parse, crt point is cHeadList
-            int k = 0;
-            for (; k < MAX_SAMPLES && idxd >= 0; ++k) {
-                idxds[j * MAX_SAMPLES + k] = idxd;
-                idxd = slist[idxd];
-            }
-            for (; k < MAX_SAMPLES; ++k) {
-                idxds[j * MAX_SAMPLES + k] = IDXDS_EMPTY;
+                // j-th of 27 neighbour buckets
+                getBucketRange(bucketStart, hashSlots, sparseLattice, hashMask, cBuck1 + (j / 9) % 3 - 1, cBuck2 + (j / 3) % 3 - 1, cBuck3 + j % 3 - 1,
+                               nBuck2, nBuck3, &idxd, &idxdEnd);
             }
-            assert(idxd < 0);
+            bucketFroms[j] = idxd;
+            candidateOffsets[j + 1] = idxdEnd - idxd;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (threadY == 0) {
+            candidateOffsets[0] = 0;
+            for (int j = 0; j < MAX_NEIGHBOURS; j++)
+                candidateOffsets[j + 1] += candidateOffsets[j];
         }
         barrier(CLK_LOCAL_MEM_FENCE);
 
-        for (int j = threadY; j < IDXDS_MAX; j += WORKGROUP_SIZE) {
-            //int idxd = idxds[j]; // BUT THIS EQUAL LINE LEADS TO -2 VGPRs ON R9 390X:
-            int idxd = idxds[(j / 256) * 256 + j % 256];
-
-            // list parse, crt point is cHeadList
-            if (idxd != IDXDS_EMPTY) {
-                int idxs = lN * idxd;
-                // determine if inside search window
-                float el, diff;
-                el = sdata[idxs + 0] - yk[0];
-                diff = el * el;
-                el = sdata[idxs + 1] - yk[1];
-                diff += el * el;
+        // all points of the buckets are candidates (however many of them there are), each thread takes every WORKGROUP_SIZE-th one
+        const int candidatesNumber = candidateOffsets[MAX_NEIGHBOURS];
+        int bucket = 0;
+        for (int c = threadY; c < candidatesNumber; c += WORKGROUP_SIZE) {
+            while (c >= candidateOffsets[bucket + 1])
+                ++bucket;
+            const int idxd = bucketFroms[bucket] + (c - candidateOffsets[bucket]);
+            // determine if inside search window
+            float el, diff;
+            el = sdata[idxd] - yk[0];
+            diff = el * el;
+            el = sdata[L + idxd] - yk[1];
+            diff += el * el;
 
-                if (diff < 1.0f) {
-                    el = sdata[idxs + 2] - yk[2];
-                    if (yk[2] > hiLTr)
-                        diff = 4.0f * el * el;
-                    else
-                        diff = el * el;
+            if (diff < 1.0f) {
+                el = sdata[2 * L + idxd] - yk[2];
+                diff = lScale * el * el;
 
 #if (N == 3)
-                    {
-                        el = sdata[idxs + 3] - yk[3];
-                        diff += el * el;
-                        el = sdata[idxs + 4] - yk[4];
-                        diff += el * el;
-                    }
+                {
+                    el = sdata[3 * L + idxd] - yk[3];
+                    diff += el * el;
+                    el = sdata[4 * L + idxd] - yk[4];
+                    diff += el * el;
+                }
 #endif
 
-                    if (diff < 1.0f) {
-                        float weight = 1.0f - weightMap[idxd];
-                        for (int k = 0; k < lN; k++)
-                            Mh[k] += weight * sdata[idxs + k];
-                        wsuml += weight;
-                    }
+                if (diff < 1.0f) {
+                    float weight = weightMap ? weights[idxd] : 1.0f;
+                    for (int k = 0; k < lN; k++)
+                        Mh[k] += weight * sdata[k * L + idxd];
+                    wsuml += weight;
                 }
             }
         }
@@ -324,3 +364,77 @@ __kernel void meanShiftFilter(__global const float* sdata,     // lN*L
         msRawData[N * i + j] = (float) (yk[j + 2] * sigmaR);
     }
 }
+
+// Workgroup per pixel, pixels of the launch are get_global_id(0)
+__attribute__((reqd_work_group_size(1, WORKGROUP_SIZE, 1)))
+__kernel void meanShiftFilter(__global const float* sdata,       // lN*L, points sorted by bucket, k-th dimension of point p is sdata[k*L + p]
+                              __global const int*   bucketStart, // nBuck1*nBuck2*nBuck3+1, points of bucket b are [bucketStart[b], bucketStart[b+1])
+                              __global const HashSlot* hashSlots, // hashMask+1, slots of the hash table (if sparseLattice instead of bucketStart)
+                              __global const float* weights,     // L, sorted by bucket, 1-weightMap (if weightMap)
+                              __global const int*   position,    // L, position of i-th pixel in sorted data
+                              __global const uchar* flat,        // L, 1 if i-th pixel is flat (it is its own mode, see ms_flat_regions.h)
+                              __global       float* msRawData,   // N*L
+                              const int L,
+                              const int width, const int height,
+                              const float sMins,
+                              const int nBuck1, const int nBuck2, const int nBuck3,
+                              const int sparseLattice, const int hashMask,
+                              const int weightMap,
+                              const float sigmaSArg, const float sigmaRArg
+)
+{
+    __local float cache[WORKGROUP_SIZE * (lN + 1)];
+    // first points of 27 neighbour buckets and offsets of their points in the list of all candidates of the window
+    // (points of a bucket are contiguous, see bucketStart and hashSlots)
+    __local int bucketFroms[MAX_NEIGHBOURS];
+    __local int candidateOffsets[MAX_NEIGHBOURS + 1];
+    assert (WORKGROUP_SIZE >= MAX_NEIGHBOURS);
+
+    meanShiftPixel(get_global_id(0), sdata, bucketStart, hashSlots, weights, position, flat, msRawData, L, width, height, sMins, nBuck1, nBuck2, nBuck3,
+                   sparseLattice, hashMask, weightMap, sigmaSArg, sigmaRArg, cache, bucketFroms, candidateOffsets);
+}
+
+// Persistent threads version of meanShiftFilter: the launch has only as many workgroups as the device runs at once, and each of them
+// takes the next pixel from the global counter when it is done with the previous one, until pixels [*nextPixel, pixelsTo) are exhausted -
+// so pixels that converge in a few iterations do not wait for slow ones of the same wave
+__attribute__((reqd_work_group_size(1, WORKGROUP_SIZE, 1)))
+__kernel void meanShiftFilterPersistent(__global const float* sdata,       // lN*L, points sorted by bucket, k-th dimension of point p is sdata[k*L + p]
+                                        __global const int*   bucketStart, // nBuck1*nBuck2*nBuck3+1, points of bucket b are [bucketStart[b], bucketStart[b+1])
+                                        __global const HashSlot* hashSlots, // hashMask+1, slots of the hash table (if sparseLattice instead of bucketStart)
+                                        __global const float* weights,     // L, sorted by bucket, 1-weightMap (if weightMap)
+                                        __global const int*   position,    // L, position of i-th pixel in sorted data
+                                        __global const uchar* flat,        // L, 1 if i-th pixel is flat (it is its own mode, see ms_flat_regions.h)
+                                        __global       float* msRawData,   // N*L
+                                        const int L,
+                                        const int width, const int height,
+                                        const float sMins,
+                                        const int nBuck1, const int nBuck2, const int nBuck3,
+                                        const int sparseLattice, const int hashMask,
+                                        const int weightMap,
+                                        const float sigmaSArg, const float sigmaRArg,
+                                        __global int* nextPixel,          // the first pixel of the launch, incremented by workgroups
+                                        const int pixelsTo
+)
+{
+    __local float cache[WORKGROUP_SIZE * (lN + 1)];
+    // first points of 27 neighbour buckets and offsets of their points in the list of all candidates of the window
+    // (points of a bucket are contiguous, see bucketStart and hashSlots)
+    __local int bucketFroms[MAX_NEIGHBOURS];
+    __local int candidateOffsets[MAX_NEIGHBOURS + 1];
+    assert (WORKGROUP_SIZE >= MAX_NEIGHBOURS);
+    __local int pixel;
+
+    while (true) {
+        if (get_local_id(1) == 0)
+            pixel = atomic_inc(nextPixel);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        const int i = pixel;
+        // pixel is overwritten only after all threads have read it (flat pixels return without barriers)
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (i >= pixelsTo)
+            break;
+
+        meanShiftPixel(i, sdata, bucketStart, hashSlots, weights, position, flat, msRawData, L, width, height, sMins, nBuck1, nBuck2, nBuck3,
+                       sparseLattice, hashMask, weightMap, sigmaSArg, sigmaRArg, cache, bucketFroms, candidateOffsets);
+    }
+}
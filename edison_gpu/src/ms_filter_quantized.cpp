@@ -0,0 +1,245 @@
+#include "../segm/msImageProcessor.h"
+#include "ms_lattice.h"
+#include "timer.h"
+#include "ms_work_stealing.h"
+#include "ms_cpu_kernels.h"
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+
+// fixed point units per pixel of x and y (less if the image is too large for int16)
+#define MS_QUANTIZED_SPATIAL_UNITS 16
+// fixed point units per LUV unit (less if range of the channel does not fit into 14 bits,
+// so that doubled differences of L and sums of squared range differences do not overflow)
+#define MS_QUANTIZED_RANGE_UNITS 64
+#define MS_QUANTIZED_RANGE_MAX 16383
+// fixed point units of kernel weights (1-weightMap), products of points and weights are accumulated in int32
+// by the kernels (see MS_QUANTIZED_FLUSH_PERIOD in ms_cpu_kernels_impl.h)
+#define MS_QUANTIZED_WEIGHT_UNITS 128
+
+// number of pixels in a block of work stealing pool
+#define MS_QUANTIZED_WORK_BLOCK_SIZE 128
+
+namespace {
+
+// Points of the lattice in int16 fixed point (10 bytes per color point instead of 40): x and y are pixel coordinates
+// multiplied by spatialUnits, channels are offsets from the minimum of the channel multiplied by rangeUnits.
+// All values are in [0, 32767], so differences of any two of them fit into int16 and sums of two squared differences
+// fit into int32. Points are stored in the order of the lattice (that is used for its buckets only).
+struct QuantizedLattice {
+	int lN;
+	int L;
+	double spatialUnits;
+	double rangeUnits;
+	double rangeMins[3];
+
+	std::vector<int16_t> sdata;     // lN*L, sorted by bucket, k-th dimension of point p is sdata[k*L + p]
+	std::vector<int16_t> weights;   // L, sorted by bucket, kernel weights in MS_QUANTIZED_WEIGHT_UNITS (if weight map is defined)
+	QuantizedPoints points;
+
+	void build(const MeanShiftLattice<float> &lattice, const float* data, const float* weightMap, int N, int width, int height);
+};
+
+void QuantizedLattice::build(const MeanShiftLattice<float> &lattice, const float* data, const float* weightMap, int N, int width, int height)
+{
+	lN = N + 2;
+	L = width*height;
+
+	double rangeMaxs[3];
+	for (int k = 0; k < N; k++)
+		rangeMins[k] = rangeMaxs[k] = data[k];
+	for (int i = 0; i < L; i++) {
+		for (int k = 0; k < N; k++) {
+			rangeMins[k] = std::min(rangeMins[k], (double) data[i*N + k]);
+			rangeMaxs[k] = std::max(rangeMaxs[k], (double) data[i*N + k]);
+		}
+	}
+	double maxRange = 0;
+	for (int k = 0; k < N; k++)
+		maxRange = std::max(maxRange, rangeMaxs[k] - rangeMins[k]);
+
+	spatialUnits = std::min((double) MS_QUANTIZED_SPATIAL_UNITS, 32767.0/std::max(std::max(width, height) - 1, 1));
+	rangeUnits = (maxRange > 0) ? std::min((double) MS_QUANTIZED_RANGE_UNITS, MS_QUANTIZED_RANGE_MAX/maxRange) : MS_QUANTIZED_RANGE_UNITS;
+
+	sdata.resize((size_t) lN*L);
+	if (weightMap)
+		weights.resize(L);
+	#pragma omp parallel for
+	for (int i = 0; i < L; i++) {
+		const int p = lattice.position[i];
+		sdata[p] = (int16_t) std::lround((i%width)*spatialUnits);
+		sdata[(size_t) L + p] = (int16_t) std::lround((i/width)*spatialUnits);
+		for (int k = 0; k < N; k++)
+			sdata[(size_t) (k + 2)*L + p] = (int16_t) std::lround((data[i*N + k] - rangeMins[k])*rangeUnits);
+		if (weightMap)
+			weights[p] = (int16_t) std::lround((1 - weightMap[i])*MS_QUANTIZED_WEIGHT_UNITS);
+	}
+	for (int k = 0; k < lN; k++)
+		points.sdims[k] = sdata.data() + (size_t) k*L;
+	points.weights = weights.data();
+}
+
+}
+
+template <int CHANNELS, bool WEIGHT_MAP>
+void msImageProcessor::NewNonOptimizedFilter_quantized_impl(float sigmaS, float sigmaR)
+{
+	// number of channels is known at compile time (hides MeanShift::N)
+	const int N = CHANNELS;
+	const int lN = N + 2;
+
+	//make sure that a lattice height and width have
+	//been defined...
+	if(!height)
+	{
+		ErrorHandler("msImageProcessor", "LFilter", "Lattice height and width are undefined.");
+		return;
+	}
+
+	//re-assign bandwidths to sigmaS and sigmaR
+	if(((h[0] = sigmaS) <= 0)||((h[1] = sigmaR) <= 0))
+	{
+		ErrorHandler("msImageProcessor", "Segment", "sigmaS and/or sigmaR is zero or negative.");
+		return;
+	}
+
+	// the lattice is used for its buckets only: its float points are released after quantization
+	performance_timer preprocessingTimer;
+	MeanShiftLattice<float> lattice;
+	lattice.build(data, weightMap, N, width, height, sigmaS, sigmaR);
+	QuantizedLattice q;
+	q.build(lattice, data, WEIGHT_MAP ? weightMap : nullptr, N, width, height);
+	std::vector<float>().swap(lattice.sdata);
+	std::vector<float>().swap(lattice.weights);
+	ReportPreprocessingTime(preprocessingTimer.elapsed());
+
+	// units of fixed point per scaled unit of the feature space (i.e. per sigma)
+	const double spatialScale = q.spatialUnits*sigmaS;
+	const double rangeScale = q.rangeUnits*sigmaR;
+	const int spatialLimit = (int) std::min(std::ceil(spatialScale*spatialScale), (double) INT_MAX);
+	const int rangeLimit = (int) std::min(std::ceil(rangeScale*rangeScale), (double) INT_MAX);
+	const double hiL = (80.0 - q.rangeMins[0])*q.rangeUnits;
+
+	// calculates the mean shift vector Mh (in fixed point units) at the window location yk
+	// (candidates are tested with the kernel of the instruction set selected at startup, see ms_cpu_kernels.h)
+	const CpuKernels &kernels = cpuKernels();
+	auto computeMSVector = [&](const double* yk, double* Mh, QuantizedSums &counters)
+	{
+		QuantizedWindow window;
+		for (int k = 0; k < lN; k++)
+			window.yk[k] = (int) std::lround(yk[k]);
+		window.spatialLimit = spatialLimit;
+		window.rangeLimit = rangeLimit;
+		window.lShift = (yk[2] > hiL) ? 1 : 0;
+
+		// find bucket of yk
+		float scaled[3] = {(float) (yk[0]/spatialScale), (float) (yk[1]/spatialScale),
+						   (float) ((yk[2]/q.rangeUnits + q.rangeMins[0])/sigmaR)};
+		int cBuck1, cBuck2, cBuck3;
+		lattice.bucketOf(scaled, cBuck1, cBuck2, cBuck3);
+
+		QuantizedSums sums = {{0, 0, 0, 0, 0}, 0, 0, 0};
+		for (int dBuck1 = -1; dBuck1 <= 1; dBuck1++) {
+			for (int dBuck2 = -1; dBuck2 <= 1; dBuck2++) {
+				int from, to;
+				lattice.neighbourRange(cBuck1 + dBuck1, cBuck2 + dBuck2, cBuck3, from, to);
+				kernels.evaluateQuantizedCandidates[lN == 5][WEIGHT_MAP](q.points, from, to, window, sums);
+			}
+		}
+		counters.examined += sums.examined;
+		counters.accepted += sums.accepted;
+
+		if (sums.w > 0) {
+			for (int k = 0; k < lN; k++)
+				Mh[k] = (double) sums.s[k]/sums.w - yk[k];
+		} else {
+			for (int k = 0; k < lN; k++)
+				Mh[k] = 0;
+		}
+	};
+
+	std::atomic<long long> candidatesExamined(0);
+	std::atomic<long long> candidatesAccepted(0);
+	std::atomic<long long> iterations(0);
+	auto processBlock = [&](int blockFrom, int blockTo)
+	{
+		QuantizedSums counters = {{0, 0, 0, 0, 0}, 0, 0, 0};
+		long long blockIterations = 0;
+		for (int i = blockFrom; i < blockTo; i++) {
+			double yk[lN], Mh[lN];
+			double mvAbs;
+			int j;
+
+			// Assign window center to the quantized data point
+			const int p = lattice.position[i];
+			for (j = 0; j < lN; j++)
+				yk[j] = q.points.sdims[j][p];
+
+			computeMSVector(yk, Mh, counters);
+
+			// Calculate its magnitude squared (in scaled units)
+			mvAbs = (Mh[0]*Mh[0] + Mh[1]*Mh[1])/(spatialScale*spatialScale);
+			for (j = 2; j < lN; j++)
+				mvAbs += Mh[j]*Mh[j]/(rangeScale*rangeScale);
+
+			// Keep shifting window center until the magnitude squared of the
+			// mean shift vector calculated at the window center location is
+			// under a specified threshold (Epsilon)
+			int iterationCount = 1;
+			while ((mvAbs >= EPSILON) && (iterationCount < LIMIT)) {
+				// Shift window location
+				for (j = 0; j < lN; j++)
+					yk[j] += Mh[j];
+
+				computeMSVector(yk, Mh, counters);
+
+				mvAbs = (Mh[0]*Mh[0] + Mh[1]*Mh[1])/(q.spatialUnits*q.spatialUnits);
+				for (j = 2; j < lN; j++)
+					mvAbs += Mh[j]*Mh[j]/(q.rangeUnits*q.rangeUnits);
+
+				iterationCount++;
+			}
+
+			// Shift window location
+			for (j = 0; j < lN; j++)
+				yk[j] += Mh[j];
+			blockIterations += iterationCount;
+
+			//store result into msRawData...
+			for (j = 0; j < N; j++)
+				msRawData[N*i + j] = (float) (yk[j + 2]/q.rangeUnits + q.rangeMins[j]);
+		}
+		candidatesExamined += counters.examined;
+		candidatesAccepted += counters.accepted;
+		iterations += blockIterations;
+	};
+
+	bool fetched = false;
+	auto fetchImage = [&](int &workFrom, int &workTo) -> bool
+	{
+		if (fetched)
+			return false;
+		fetched = true;
+		workFrom = 0;
+		workTo = L;
+		return true;
+	};
+	filterStatistics.threadsIdleTime = WorkStealingPool::instance().run(fetchImage, processBlock, MS_QUANTIZED_WORK_BLOCK_SIZE);
+	filterStatistics.candidatesExamined += candidatesExamined;
+	filterStatistics.candidatesAccepted += candidatesAccepted;
+	filterStatistics.iterations += iterations;
+}
+
+void msImageProcessor::NewNonOptimizedFilter_quantized(float sigmaS, float sigmaR)
+{
+	if (N == 3)
+		weightMapDefined ? NewNonOptimizedFilter_quantized_impl<3, true>(sigmaS, sigmaR)
+						 : NewNonOptimizedFilter_quantized_impl<3, false>(sigmaS, sigmaR);
+	else
+		weightMapDefined ? NewNonOptimizedFilter_quantized_impl<1, true>(sigmaS, sigmaR)
+						 : NewNonOptimizedFilter_quantized_impl<1, false>(sigmaS, sigmaR);
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+// Limits of deviations of colors of the pixels of an almost flat tile (and of its neighbourhood) from the mean color of the tile
+// relative to sigmaR: root mean square deviation and maximal one (any two of these pixels are inside of the range windows
+// of each other, L is weighted as in search windows)
+#ifndef MS_FLAT_TILE_RMS_DEVIATION
+#define MS_FLAT_TILE_RMS_DEVIATION 0.2
+#endif
+#ifndef MS_FLAT_TILE_MAX_DEVIATION
+#define MS_FLAT_TILE_MAX_DEVIATION 0.5
+#endif
+
+// Flat areas of the image, found by a pre-pass before filtering.
+//
+// Pixel is flat if all pixels of the square of (2*radius+1)^2 pixels centered at it (radius = floor(sigmaS)+1, so that the square
+// covers the spatial window) have exactly the same color and the square is inside of the image. Window of such pixel contains only
+// points of its own color placed symmetrically around it, so its mean shift vector is zero and the pixel is its own mode
+// (if there is no weight map) - the filter can write it without scanning of the lattice.
+//
+// Tile of sigmaS x sigmaS pixels is almost flat if colors of its pixels and of the pixels around it (within the same radius)
+// deviate from the mean color of the tile by less than MS_FLAT_TILE_RMS_DEVIATION*sigmaR on average and MS_FLAT_TILE_MAX_DEVIATION*sigmaR
+// at most. Windows of the pixels of such tile converge to nearly the same mode, so it is found once from the centroid of the tile
+// (approximately, built only if requested).
+class FlatRegions {
+public:
+	std::vector<unsigned char> flat;        // L, 1 if the pixel is flat
+	int flatPixelsNumber = 0;
+	std::vector<int> tileOfPixel;           // L, almost flat tile of the pixel or -1 (flat pixels do not belong to tiles)
+	std::vector<double> tileCentroids;      // N + 2 per almost flat tile: x, y and color (not scaled)
+
+	void build(const float* data, int N, int width, int height, float sigmaS, float sigmaR, bool tiles)
+	{
+		const int L = width*height;
+		const int radius = (int) std::floor(sigmaS) + 1;
+
+		auto sameColor = [&](int i, int j) -> bool
+		{
+			for (int k = 0; k < N; k++)
+				if (data[i*N + k] != data[j*N + k])
+					return false;
+			return true;
+		};
+
+		// integral images of color edges between horizontal and vertical neighbours:
+		// edges*[(y + 1)*(width + 1) + x + 1] is the number of edges to the right (below) of pixels [0, x] x [0, y]
+		std::vector<int> edgesH((size_t) (width + 1)*(height + 1), 0);
+		std::vector<int> edgesV((size_t) (width + 1)*(height + 1), 0);
+		for (int y = 0; y < height; y++) {
+			int rowH = 0, rowV = 0;
+			for (int x = 0; x < width; x++) {
+				const int i = y*width + x;
+				rowH += (x + 1 < width && !sameColor(i, i + 1)) ? 1 : 0;
+				rowV += (y + 1 < height && !sameColor(i, i + width)) ? 1 : 0;
+				edgesH[(size_t) (y + 1)*(width + 1) + x + 1] = edgesH[(size_t) y*(width + 1) + x + 1] + rowH;
+				edgesV[(size_t) (y + 1)*(width + 1) + x + 1] = edgesV[(size_t) y*(width + 1) + x + 1] + rowV;
+			}
+		}
+		// number of edges of pixels [x0, x1] x [y0, y1]
+		auto edgesIn = [&](const std::vector<int> &edges, int x0, int y0, int x1, int y1) -> int
+		{
+			return edges[(size_t) (y1 + 1)*(width + 1) + x1 + 1] - edges[(size_t) y0*(width + 1) + x1 + 1]
+				 - edges[(size_t) (y1 + 1)*(width + 1) + x0] + edges[(size_t) y0*(width + 1) + x0];
+		};
+
+		flat.assign(L, 0);
+		flatPixelsNumber = 0;
+		for (int y = radius; y + radius < height; y++) {
+			for (int x = radius; x + radius < width; x++) {
+				// the square is of the same color if there are no edges inside of it
+				if (edgesIn(edgesH, x - radius, y - radius, x + radius - 1, y + radius) == 0
+					&& edgesIn(edgesV, x - radius, y - radius, x + radius, y + radius - 1) == 0) {
+					flat[y*width + x] = 1;
+					flatPixelsNumber++;
+				}
+			}
+		}
+
+		tileOfPixel.clear();
+		tileCentroids.clear();
+		if (!tiles)
+			return;
+
+		tileOfPixel.assign(L, -1);
+		const int lN = N + 2;
+		const int tileSize = std::max((int) sigmaS, 1);
+		const double rmsDeviation = MS_FLAT_TILE_RMS_DEVIATION*sigmaR;
+		const double maxDeviation = MS_FLAT_TILE_MAX_DEVIATION*sigmaR;
+		for (int tileY = 0; tileY < height; tileY += tileSize) {
+			for (int tileX = 0; tileX < width; tileX += tileSize) {
+				const int tileXEnd = std::min(tileX + tileSize, width);
+				const int tileYEnd = std::min(tileY + tileSize, height);
+
+				double centroid[5] = {0, 0, 0, 0, 0};
+				int count = 0;
+				for (int y = tileY; y < tileYEnd; y++) {
+					for (int x = tileX; x < tileXEnd; x++) {
+						const int i = y*width + x;
+						if (flat[i])
+							continue;
+						centroid[0] += x;
+						centroid[1] += y;
+						for (int k = 0; k < N; k++)
+							centroid[k + 2] += data[i*N + k];
+						count++;
+					}
+				}
+				// tiles of flat pixels need no computation
+				if (count == 0)
+					continue;
+				for (int k = 0; k < lN; k++)
+					centroid[k] /= count;
+
+				// the same range weighting as in search windows (see hiLTr in the filter)
+				const double lScale = (centroid[2] > 80.0) ? 4 : 1;
+				bool almostFlat = true;
+				double distSum = 0;
+				int distCount = 0;
+				for (int y = std::max(tileY - radius, 0); y < std::min(tileYEnd + radius, height) && almostFlat; y++) {
+					for (int x = std::max(tileX - radius, 0); x < std::min(tileXEnd + radius, width); x++) {
+						const float* color = &data[(y*width + x)*N];
+						double el = color[0] - centroid[2];
+						double dist = lScale*el*el;
+						for (int k = 1; k < N; k++) {
+							el = color[k] - centroid[k + 2];
+							dist += el*el;
+						}
+						if (dist >= maxDeviation*maxDeviation) {
+							almostFlat = false;
+							break;
+						}
+						distSum += dist;
+						distCount++;
+					}
+				}
+				if (!almostFlat || distSum >= rmsDeviation*rmsDeviation*distCount)
+					continue;
+
+				const int tile = (int) (tileCentroids.size()/lN);
+				tileCentroids.insert(tileCentroids.end(), centroid, centroid + lN);
+				for (int y = tileY; y < tileYEnd; y++)
+					for (int x = tileX; x < tileXEnd; x++)
+						if (!flat[y*width + x])
+							tileOfPixel[y*width + x] = tile;
+			}
+		}
+	}
+};
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <climits>
+
+// Dense grid of buckets is replaced with the sparse hashed one if it takes more memory than this
+// (with small sigmaS/sigmaR on large images the dense grid is huge and mostly empty)
+#ifndef MS_LATTICE_MAX_DENSE_BYTES
+#define MS_LATTICE_MAX_DENSE_BYTES (64*1024*1024)
+#endif
+
+// Number of buckets along u and v per range bandwidth in the lattice with 5d buckets
+// (finer buckets reject more points that are outside of the search window, but need more lookups)
+#ifndef MS_COLOR_BUCKETS_PER_SIGMA
+#define MS_COLOR_BUCKETS_PER_SIGMA 1
+#endif
+
+// Index of the scaled data points in the 3d buckets (x, y, L) of the mean shift lattice.
+//
+// Points are physically sorted by bucket (CSR-like storage): points of bucket b are stored
+// in [bucketStart[b], bucketStart[b+1]), so each bucket is scanned sequentially instead of
+// walking a linked list (buckets + slist) over randomly placed points.
+//
+// Buckets are ordered with L as the fastest dimension, so three buckets adjacent along L
+// form a single contiguous range and 27 neighbour buckets are scanned as 9 ranges.
+// Inside of each bucket points are ordered by descending pixel index - the same order in which
+// the original linked lists were traversed, so the order of accumulation is not changed.
+//
+// If the dense grid of buckets is too big (see MS_LATTICE_MAX_DENSE_BYTES) - the lattice is sparse:
+// bucketStart is not allocated, and ranges of non-empty buckets are stored in the hash table with
+// open addressing (linear probing) keyed on bucket coordinates. Each slot stores the range of its bucket
+// and the range of three buckets adjacent along L centered at it (slots are created for empty buckets
+// next to non-empty ones too), so a window still needs just 9 lookups.
+//
+// Lattice of color image can also bin points on u and v (colorBuckets) - then buckets are 5d (x, y, L, u, v)
+// and the lattice is always sparse. Buckets along u and v are MS_COLOR_BUCKETS_PER_SIGMA times smaller than along L.
+// L is still the fastest dimension, so a window needs only lookups of ranges of three buckets adjacent along L
+// (of neighbours along x, y, u and v - see evaluateColorNeighbourBuckets for pruning of this stencil).
+template <typename T>
+class MeanShiftLattice {
+public:
+	int lN;
+	int L;
+	int nBuck1, nBuck2, nBuck3;
+	int nBuck4, nBuck5;             // number of buckets along u and v (1 if points are not binned on them)
+	T sMins; // just for L
+	T uvMins[2];                    // for u and v (if colorBuckets)
+	bool colorBuckets;
+
+	std::vector<T>     sdata;       // lN*L, sorted by bucket, k-th dimension of point p is sdata[k*L + p]
+	std::vector<float> weights;     // L, sorted by bucket, kernel weights (1-weightMap)
+	std::vector<int>   position;    // L, position of i-th pixel in sorted data
+	std::vector<int>   bucketStart; // nBuck1*nBuck2*nBuck3+1 (empty if the lattice is sparse)
+
+	// sparse lattice (slot is a single cache line access, layout is shared with the OpenCL kernel)
+	struct HashSlot {
+		long long key;                      // bucketKey(), or -1 if the slot is empty
+		int bucketFrom, bucketTo;           // range of points of the bucket
+		int neighboursFrom, neighboursTo;   // range of points of the buckets [cBuck3-1, cBuck3+1]
+	};
+	bool                  sparse;
+	int                   hashMask;         // number of slots - 1 (power of two)
+	std::vector<HashSlot> hashSlots;
+
+	void build(const float* data, const float* weightMap, int N, int width, int height, float sigmaS, float sigmaR,
+			   bool colorBuckets = false);
+
+	int bucketIndex(int cBuck1, int cBuck2, int cBuck3) const
+	{
+		return cBuck3 + nBuck3*(cBuck2 + nBuck2*cBuck1);
+	}
+
+	// the same as bucketIndex, but can not overflow (used as a key in the sparse lattice)
+	long long bucketKey(int cBuck1, int cBuck2, int cBuck3, int cBuck4 = 0, int cBuck5 = 0) const
+	{
+		return cBuck3 + (long long) nBuck3*(cBuck5 + (long long) nBuck5*(cBuck4 + (long long) nBuck4*(cBuck2 + (long long) nBuck2*cBuck1)));
+	}
+
+	static unsigned int hashOf(long long key)
+	{
+		return (unsigned int) (((unsigned long long) key * 0x9E3779B97F4A7C15ull) >> 32);
+	}
+
+	// returns the slot of the sparse lattice with the given key, or -1 if there is no such slot
+	int findSlot(long long key) const
+	{
+		for (unsigned int slot = hashOf(key) & hashMask; ; slot = (slot + 1) & hashMask) {
+			if (hashSlots[slot].key == key)
+				return (int) slot;
+			if (hashSlots[slot].key == -1)
+				return -1;
+		}
+	}
+
+	// returns bucket coordinates of window center yk
+	void bucketOf(const T* yk, int &cBuck1, int &cBuck2, int &cBuck3) const
+	{
+		cBuck1 = (int) yk[0] + 1;
+		cBuck2 = (int) yk[1] + 1;
+		cBuck3 = (int) (yk[2] - sMins) + 1;
+	}
+
+	// returns bucket coordinates of window center yk along u and v (if colorBuckets)
+	void colorBucketOf(const T* yk, int &cBuck4, int &cBuck5) const
+	{
+		cBuck4 = (int) ((yk[3] - uvMins[0])*MS_COLOR_BUCKETS_PER_SIGMA) + MS_COLOR_BUCKETS_PER_SIGMA;
+		cBuck5 = (int) ((yk[4] - uvMins[1])*MS_COLOR_BUCKETS_PER_SIGMA) + MS_COLOR_BUCKETS_PER_SIGMA;
+	}
+
+	// returns the lowest u and v of the bucket (if colorBuckets)
+	T colorBucketLow(int k, int cBuck) const
+	{
+		return uvMins[k] + (T) (cBuck - MS_COLOR_BUCKETS_PER_SIGMA)/MS_COLOR_BUCKETS_PER_SIGMA;
+	}
+
+	// returns the range [from, to) of points of the bucket
+	void bucketRange(int cBuck1, int cBuck2, int cBuck3, int &from, int &to) const
+	{
+		if (!sparse) {
+			const int b = bucketIndex(cBuck1, cBuck2, cBuck3);
+			from = bucketStart[b];
+			to = bucketStart[b + 1];
+		} else {
+			const int slot = findSlot(bucketKey(cBuck1, cBuck2, cBuck3));
+			from = (slot == -1) ? 0 : hashSlots[slot].bucketFrom;
+			to   = (slot == -1) ? 0 : hashSlots[slot].bucketTo;
+		}
+	}
+
+	// returns the range [from, to) of points of the three buckets (cBuck1, cBuck2, cBuck3-1..cBuck3+1)
+	void neighbourRange(int cBuck1, int cBuck2, int cBuck3, int &from, int &to) const
+	{
+		if (!sparse) {
+			const int b = bucketIndex(cBuck1, cBuck2, cBuck3 - 1);
+			from = bucketStart[b];
+			to = bucketStart[b + 3];
+		} else {
+			const int slot = findSlot(bucketKey(cBuck1, cBuck2, cBuck3));
+			from = (slot == -1) ? 0 : hashSlots[slot].neighboursFrom;
+			to   = (slot == -1) ? 0 : hashSlots[slot].neighboursTo;
+		}
+	}
+
+	// returns the range [from, to) of points of the three 5d buckets (cBuck1, cBuck2, cBuck3-1..cBuck3+1, cBuck4, cBuck5)
+	// (bucket coordinates along u and v must be in [0, nBuck4) and [0, nBuck5))
+	void neighbourRange(int cBuck1, int cBuck2, int cBuck3, int cBuck4, int cBuck5, int &from, int &to) const
+	{
+		const int slot = findSlot(bucketKey(cBuck1, cBuck2, cBuck3, cBuck4, cBuck5));
+		from = (slot == -1) ? 0 : hashSlots[slot].neighboursFrom;
+		to   = (slot == -1) ? 0 : hashSlots[slot].neighboursTo;
+	}
+
+	long long bucketsNumber() const
+	{
+		return (long long) nBuck1*nBuck2*nBuck3*nBuck4*nBuck5;
+	}
+
+private:
+	int insertSlot(long long key);
+};
+
+template <typename T>
+int MeanShiftLattice<T>::insertSlot(long long key)
+{
+	unsigned int slot = hashOf(key) & hashMask;
+	while (hashSlots[slot].key != -1 && hashSlots[slot].key != key)
+		slot = (slot + 1) & hashMask;
+	if (hashSlots[slot].key == -1) {
+		hashSlots[slot].key = key;
+		hashSlots[slot].bucketFrom = 0;
+		hashSlots[slot].bucketTo = 0;
+		hashSlots[slot].neighboursFrom = INT_MAX;
+		hashSlots[slot].neighboursTo = INT_MIN;
+	}
+	return (int) slot;
+}
+
+template <typename T>
+void MeanShiftLattice<T>::build(const float* data, const float* weightMap, int N, int width, int height, float sigmaS, float sigmaR,
+								bool colorBuckets)
+{
+	lN = N + 2;
+	L = width*height;
+	this->colorBuckets = colorBuckets = colorBuckets && (N == 3);
+
+	T sMaxs[3]; // for all
+	sMaxs[0] = width/sigmaS;
+	sMaxs[1] = height/sigmaS;
+
+	// L-range (and u/v-range for color buckets) scan with per-thread partial min/max
+	const int nScanned = colorBuckets ? 3 : 1;
+	T rangeMins[3], rangeMaxs[3];
+	for (int k = 0; k < nScanned; k++)
+		rangeMins[k] = rangeMaxs[k] = data[k]/sigmaR;
+	#pragma omp parallel
+	{
+		T threadMins[3], threadMaxs[3];
+		for (int k = 0; k < nScanned; k++) {
+			threadMins[k] = rangeMins[k];
+			threadMaxs[k] = rangeMaxs[k];
+		}
+		#pragma omp for nowait
+		for (int i = 0; i < L; i++) {
+			for (int k = 0; k < nScanned; k++) {
+				T cval = data[i*N + k]/sigmaR;
+				if (cval < threadMins[k])
+					threadMins[k] = cval;
+				else if (cval > threadMaxs[k])
+					threadMaxs[k] = cval;
+			}
+		}
+		#pragma omp critical
+		{
+			for (int k = 0; k < nScanned; k++) {
+				if (threadMins[k] < rangeMins[k])
+					rangeMins[k] = threadMins[k];
+				if (threadMaxs[k] > rangeMaxs[k])
+					rangeMaxs[k] = threadMaxs[k];
+			}
+		}
+	}
+	sMins = rangeMins[0];
+	sMaxs[2] = rangeMaxs[0];
+
+	nBuck1 = (int) (sMaxs[0] + 3);
+	nBuck2 = (int) (sMaxs[1] + 3);
+	nBuck3 = (int) (sMaxs[2] - sMins + 3);
+	nBuck4 = nBuck5 = 1;
+
+	if (colorBuckets) {
+		uvMins[0] = rangeMins[1];
+		uvMins[1] = rangeMins[2];
+		nBuck4 = (int) ((rangeMaxs[1] - uvMins[0])*MS_COLOR_BUCKETS_PER_SIGMA) + 2*MS_COLOR_BUCKETS_PER_SIGMA + 1;
+		nBuck5 = (int) ((rangeMaxs[2] - uvMins[1])*MS_COLOR_BUCKETS_PER_SIGMA) + 2*MS_COLOR_BUCKETS_PER_SIGMA + 1;
+	}
+	sparse = colorBuckets || (bucketsNumber() + 1)*(long long) sizeof(int) > MS_LATTICE_MAX_DENSE_BYTES;
+
+	// rows of pixels are split into bands with the same cBuck2 - buckets of different bands
+	// are disjoint, so bands can be counted and scattered in parallel without any synchronization
+	std::vector<std::pair<int, int>> bands;
+	int prevBuck2 = -1;
+	for (int y = 0; y < height; y++) {
+		T sy = y/sigmaS;
+		int cBuck2 = (int) sy + 1;
+		if (cBuck2 != prevBuck2) {
+			bands.push_back(std::pair<int, int>(y, y + 1));
+			prevBuck2 = cBuck2;
+		} else {
+			bands.back().second = y + 1;
+		}
+	}
+	const int nBands = (int) bands.size();
+
+	// find bucket for each data point (and count points in each bucket of the dense lattice)
+	std::vector<long long> keys(L);
+	if (!sparse) {
+		bucketStart.assign(bucketsNumber() + 1, 0);
+		hashSlots.clear();
+	} else {
+		bucketStart.clear();
+	}
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int band = 0; band < nBands; band++) {
+		for (int i = bands[band].first*width; i < bands[band].second*width; i++) {
+			T sx = (i%width)/sigmaS;
+			T sy = (i/width)/sigmaS;
+			T sl = data[i*N]/sigmaR;
+			int cBuck1 = (int) sx + 1;
+			int cBuck2 = (int) sy + 1;
+			int cBuck3 = (int) (sl - sMins) + 1;
+			int cBuck4 = 0, cBuck5 = 0;
+			if (colorBuckets) {
+				T point[5] = {sx, sy, sl, data[i*N + 1]/sigmaR, data[i*N + 2]/sigmaR};
+				colorBucketOf(point, cBuck4, cBuck5);
+			}
+			keys[i] = bucketKey(cBuck1, cBuck2, cBuck3, cBuck4, cBuck5);
+			if (!sparse)
+				bucketStart[keys[i] + 1]++;
+		}
+	}
+
+	// order of points (pixel indices in sorted data)
+	std::vector<int> order;
+	if (!sparse) {
+		for (int b = 0; b < bucketsNumber(); b++)
+			bucketStart[b + 1] += bucketStart[b];
+	} else {
+		// band occupies the same range of sorted data as its pixels, and is sorted by bucket inside
+		// (points of a bucket stay in descending order of pixel index)
+		order.resize(L);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int band = 0; band < nBands; band++) {
+			const int bandFrom = bands[band].first*width;
+			const int bandTo = bands[band].second*width;
+			for (int p = bandFrom; p < bandTo; p++)
+				order[p] = bandTo - 1 - (p - bandFrom);
+			std::stable_sort(order.begin() + bandFrom, order.begin() + bandTo,
+							 [&keys](int a, int b) { return keys[a] < keys[b]; });
+		}
+	}
+
+	// scatter points to sorted positions (in descending order of pixel index inside each bucket)
+	std::vector<int> cursor(bucketStart.begin(), bucketStart.empty() ? bucketStart.end() : bucketStart.end() - 1);
+	sdata.resize(lN*L);
+	weights.resize(L);
+	position.resize(L);
+	auto storePoint = [&](int i, int p)
+	{
+		position[i] = p;
+		sdata[p] = (i%width)/sigmaS;
+		sdata[L + p] = (i/width)/sigmaS;
+		for (int j = 0; j < N; j++)
+			sdata[(j + 2)*L + p] = data[i*N + j]/sigmaR;
+		weights[p] = 1-weightMap[i];
+	};
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int band = 0; band < nBands; band++) {
+		if (!sparse) {
+			for (int i = bands[band].second*width - 1; i >= bands[band].first*width; i--)
+				storePoint(i, cursor[keys[i]]++);
+		} else {
+			for (int p = bands[band].first*width; p < bands[band].second*width; p++)
+				storePoint(order[p], p);
+		}
+	}
+
+	if (!sparse)
+		return;
+
+	// runs of points of non-empty buckets
+	std::vector<std::pair<long long, std::pair<int, int>>> runs;
+	for (int p = 0; p < L; p++) {
+		const long long key = keys[order[p]];
+		if (runs.empty() || runs.back().first != key)
+			runs.push_back(std::make_pair(key, std::make_pair(p, p + 1)));
+		else
+			runs.back().second.second = p + 1;
+	}
+
+	// each non-empty bucket creates at most three slots, so hash table is at most 3/4 full
+	unsigned int slotsNumber = 1;
+	while (slotsNumber < 4*runs.size())
+		slotsNumber *= 2;
+	hashMask = (int) slotsNumber - 1;
+	HashSlot emptySlot = {-1, 0, 0, 0, 0};
+	hashSlots.assign(slotsNumber, emptySlot);
+	for (size_t r = 0; r < runs.size(); r++) {
+		const long long key = runs[r].first;
+		const int from = runs[r].second.first;
+		const int to = runs[r].second.second;
+		const int slot = insertSlot(key);
+		hashSlots[slot].bucketFrom = from;
+		hashSlots[slot].bucketTo = to;
+
+		// the bucket is a part of neighbour ranges centered at it and at two buckets adjacent along L
+		const int cBuck3 = (int) (key % nBuck3);
+		for (int dBuck3 = -1; dBuck3 <= 1; dBuck3++) {
+			if (cBuck3 + dBuck3 < 0 || cBuck3 + dBuck3 >= nBuck3)
+				continue;
+			const int center = insertSlot(key + dBuck3);
+			hashSlots[center].neighboursFrom = std::min(hashSlots[center].neighboursFrom, from);
+			hashSlots[center].neighboursTo = std::max(hashSlots[center].neighboursTo, to);
+		}
+	}
+}
+
+// Compact copy of the lattice buckets around a 2d tile of pixels.
+//
+// Windows of neighbouring pixels start in almost the same place and scan almost the same buckets,
+// so candidates of the whole tile are gathered once into a small contiguous buffer (with its own CSR
+// bucketStart) and trajectories inside of the gathered envelope are iterated over it only.
+// Buckets are copied as whole contiguous ranges along L, so the order of points is the same
+// as in the lattice and the results are bit-equal.
+template <typename T>
+class MeanShiftTileLattice {
+public:
+	int lN;
+	int size;                           // number of gathered points
+	int from1, from2, from3;            // coordinates of the first gathered bucket in the lattice
+	int nBuck1, nBuck2, nBuck3;         // number of gathered buckets along each dimension
+
+	std::vector<T>     sdata;           // lN*size, k-th dimension of point p is sdata[k*size + p]
+	std::vector<float> weights;         // size
+	std::vector<int>   bucketStart;     // nBuck1*nBuck2*nBuck3+1
+
+	// gathers buckets [min1, max1]x[min2, max2]x[min3, max3] (clamped to the lattice bounds)
+	void gather(const MeanShiftLattice<T> &lattice, int min1, int max1, int min2, int max2, int min3, int max3);
+
+	int bucketIndex(int cBuck1, int cBuck2, int cBuck3) const
+	{
+		return (cBuck3 - from3) + nBuck3*((cBuck2 - from2) + nBuck2*(cBuck1 - from1));
+	}
+
+	// returns the range [from, to) of points of the three buckets (cBuck1, cBuck2, cBuck3-1..cBuck3+1)
+	void neighbourRange(int cBuck1, int cBuck2, int cBuck3, int &from, int &to) const
+	{
+		const int b = bucketIndex(cBuck1, cBuck2, cBuck3 - 1);
+		from = bucketStart[b];
+		to = bucketStart[b + 3];
+	}
+
+	// returns true if all 27 neighbour buckets of the window bucket were gathered
+	bool covers(int cBuck1, int cBuck2, int cBuck3) const
+	{
+		return cBuck1 - 1 >= from1 && cBuck1 + 1 < from1 + nBuck1
+			&& cBuck2 - 1 >= from2 && cBuck2 + 1 < from2 + nBuck2
+			&& cBuck3 - 1 >= from3 && cBuck3 + 1 < from3 + nBuck3;
+	}
+};
+
+template <typename T>
+void MeanShiftTileLattice<T>::gather(const MeanShiftLattice<T> &lattice, int min1, int max1, int min2, int max2, int min3, int max3)
+{
+	lN = lattice.lN;
+	from1 = std::max(min1, 0);
+	from2 = std::max(min2, 0);
+	from3 = std::max(min3, 0);
+	nBuck1 = std::max(std::min(max1, lattice.nBuck1 - 1) - from1 + 1, 0);
+	nBuck2 = std::max(std::min(max2, lattice.nBuck2 - 1) - from2 + 1, 0);
+	nBuck3 = std::max(std::min(max3, lattice.nBuck3 - 1) - from3 + 1, 0);
+
+	// buckets are copied in the same order as they are stored in the lattice
+	bucketStart.resize(nBuck1*nBuck2*nBuck3 + 1);
+	size = 0;
+	for (int b1 = 0; b1 < nBuck1; b1++) {
+		for (int b2 = 0; b2 < nBuck2; b2++) {
+			for (int b3 = 0; b3 < nBuck3; b3++) {
+				int from, to;
+				lattice.bucketRange(from1 + b1, from2 + b2, from3 + b3, from, to);
+				bucketStart[b3 + nBuck3*(b2 + nBuck2*b1)] = size;
+				size += to - from;
+			}
+		}
+	}
+	bucketStart[nBuck1*nBuck2*nBuck3] = size;
+
+	sdata.resize(lN*size);
+	weights.resize(size);
+	for (int b1 = 0; b1 < nBuck1; b1++) {
+		for (int b2 = 0; b2 < nBuck2; b2++) {
+			for (int b3 = 0; b3 < nBuck3; b3++) {
+				int from, to;
+				lattice.bucketRange(from1 + b1, from2 + b2, from3 + b3, from, to);
+				const int p = bucketStart[b3 + nBuck3*(b2 + nBuck2*b1)];
+				for (int k = 0; k < lN; k++)
+					std::copy(lattice.sdata.begin() + k*lattice.L + from, lattice.sdata.begin() + k*lattice.L + to,
+							  sdata.begin() + k*size + p);
+				std::copy(lattice.weights.begin() + from, lattice.weights.begin() + to, weights.begin() + p);
+			}
+		}
+	}
+}
@@ -0,0 +1,191 @@
+#include "ms_work_stealing.h"
+#include "timer.h"
+
+#include <omp.h>
+#include <algorithm>
+
+WorkStealingPool& WorkStealingPool::instance()
+{
+    static WorkStealingPool pool(omp_get_max_threads());
+    return pool;
+}
+
+WorkStealingPool::WorkStealingPool(int nthreads)
+    : fetch(nullptr), process(nullptr), blockSize(1), fetchExhausted(true), pendingPixels(0),
+      jobGeneration(0), activeWorkers(0), stopping(false)
+{
+    nthreads = std::max(1, nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        workers.emplace_back(new Worker());
+        workers[i]->from = workers[i]->to = 0;
+        workers[i]->busyTime = 0.0;
+    }
+    // worker 0 is the thread that calls run()
+    for (int i = 1; i < nthreads; ++i) {
+        threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        stopping = true;
+    }
+    jobStarted.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+std::vector<double> WorkStealingPool::run(const FetchFunction &fetch, const ProcessFunction &process, int blockSize)
+{
+    std::lock_guard<std::mutex> runGuard(runLock);
+
+    performance_timer timer;
+
+    this->fetch = &fetch;
+    this->process = &process;
+    this->blockSize = std::max(1, blockSize);
+    fetchExhausted = false;
+    pendingPixels = 0;
+    for (auto &worker : workers) {
+        worker->from = worker->to = 0;
+        worker->busyTime = 0.0;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        activeWorkers = (int) threads.size();
+        ++jobGeneration;
+    }
+    jobStarted.notify_all();
+
+    processAll(0);
+
+    {
+        std::unique_lock<std::mutex> guard(jobLock);
+        jobFinished.wait(guard, [this] { return activeWorkers == 0; });
+    }
+
+    double wallTime = timer.elapsed();
+    std::vector<double> idleTimes(workers.size());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        idleTimes[i] = std::max(0.0, wallTime - workers[i]->busyTime);
+    }
+
+    this->fetch = nullptr;
+    this->process = nullptr;
+    return idleTimes;
+}
+
+void WorkStealingPool::workerLoop(int index)
+{
+    unsigned long long processedGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(jobLock);
+            jobStarted.wait(guard, [this, processedGeneration] { return stopping || jobGeneration != processedGeneration; });
+            if (stopping)
+                return;
+            processedGeneration = jobGeneration;
+        }
+
+        processAll(index);
+
+        {
+            std::lock_guard<std::mutex> guard(jobLock);
+            --activeWorkers;
+        }
+        jobFinished.notify_all();
+    }
+}
+
+void WorkStealingPool::processAll(int index)
+{
+    Worker &worker = *workers[index];
+    while (true) {
+        int from, to;
+        if (popBlock(index, from, to)) {
+            performance_timer busyTimer;
+            (*process)(from, to);
+            worker.busyTime += busyTimer.elapsed();
+            continue;
+        }
+
+        if (stealBlocks(index) || fetchBlocks(index))
+            continue;
+
+        // there is no more work to fetch, so work can be found only in deques of other workers
+        if (pendingPixels == 0)
+            return;
+        std::this_thread::yield();
+    }
+}
+
+bool WorkStealingPool::popBlock(int index, int &from, int &to)
+{
+    Worker &worker = *workers[index];
+    std::lock_guard<std::mutex> guard(worker.lock);
+    if (worker.from >= worker.to)
+        return false;
+
+    from = worker.from;
+    to = std::min(worker.to, worker.from + blockSize);
+    worker.from = to;
+    pendingPixels -= to - from;
+    return true;
+}
+
+bool WorkStealingPool::stealBlocks(int index)
+{
+    const int n = (int) workers.size();
+    for (int k = 1; k < n; ++k) {
+        Worker &victim = *workers[(index + k) % n];
+        int from, to;
+        {
+            std::lock_guard<std::mutex> guard(victim.lock);
+            int blocks = (victim.to - victim.from + blockSize - 1) / blockSize;
+            if (blocks <= 1)
+                continue; // the last block is left to its owner
+
+            // steal the back half of blocks
+            from = victim.from + (blocks / 2) * blockSize;
+            to = victim.to;
+            victim.to = from;
+        }
+
+        Worker &worker = *workers[index];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.from = from;
+        worker.to = to;
+        return true;
+    }
+    return false;
+}
+
+bool WorkStealingPool::fetchBlocks(int index)
+{
+    std::lock_guard<std::mutex> fetchGuard(fetchLock);
+    if (fetchExhausted)
+        return false;
+
+    // while waiting for the lock another worker could fetch a range - steal from it instead of holding one more range
+    if (pendingPixels > 0)
+        return true;
+
+    int from, to;
+    if (!(*fetch)(from, to)) {
+        fetchExhausted = true;
+        return false;
+    }
+
+    // pending pixels are increased under fetch lock, so worker that failed to fetch
+    // will not stop while fetched work is not placed into deque yet
+    pendingPixels += to - from;
+    Worker &worker = *workers[index];
+    std::lock_guard<std::mutex> guard(worker.lock);
+    worker.from = from;
+    worker.to = to;
+    return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+// Persistent pool of CPU worker threads with work stealing.
+//
+// Each worker owns a deque of pixel blocks - a contiguous range [from, to) of pixels, that is processed
+// by the owner from the front block by block, while idle workers steal the back half of it.
+// When nothing can be stolen, a worker fetches the next range of work (e.g. from the queue shared with GPUs),
+// so there is no barrier between ranges - workers stop only when all work is done.
+class WorkStealingPool {
+public:
+    // fetches next range of work [from, to), returns false if there is no more work (called under internal lock)
+    typedef std::function<bool(int &from, int &to)> FetchFunction;
+    // processes pixels [from, to)
+    typedef std::function<void(int from, int to)> ProcessFunction;
+
+    // shared pool with a thread per core (omp_get_max_threads(), so OMP_NUM_THREADS is respected)
+    static WorkStealingPool& instance();
+
+    explicit WorkStealingPool(int nthreads);
+    ~WorkStealingPool();
+
+    int threadsNumber() const { return (int) workers.size(); }
+
+    // Processes all work with blocks of blockSize pixels (calling thread is used as one of workers),
+    // returns idle time (in seconds) of each worker thread. Concurrent calls are serialized.
+    std::vector<double> run(const FetchFunction &fetch, const ProcessFunction &process, int blockSize);
+
+private:
+    // workers are allocated separately and padded with a cache line (alignas is not honored by new in C++11),
+    // so deques of different workers do not share cache lines
+    struct Worker {
+        std::mutex lock;
+        int from;
+        int to;
+        double busyTime;
+        char padding[64];
+    };
+
+    void workerLoop(int index);
+    void processAll(int index);
+    bool popBlock(int index, int &from, int &to);
+    bool stealBlocks(int index);
+    bool fetchBlocks(int index);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex runLock;
+
+    // current job
+    const FetchFunction   *fetch;
+    const ProcessFunction *process;
+    int blockSize;
+    std::mutex fetchLock;
+    bool fetchExhausted;
+    std::atomic<long long> pendingPixels; // pixels in deques of all workers (not taken for processing yet)
+
+    // job distribution between persistent threads
+    std::mutex jobLock;
+    std::condition_variable jobStarted;
+    std::condition_variable jobFinished;
+    unsigned long long jobGeneration;
+    int activeWorkers;
+    bool stopping;
+};
@@ -5,18 +5,31 @@
 #include "Device.h"
 #include "Kernel.h"
 
+#include <map>
+#include <mutex>
+#include <vector>
+
 namespace cl {
 
+    // CL_UTILS_BINARY_CACHE_DIR environment variable if it is set (empty - the cache is disabled), per-user
+    // cl_utils_binary_cache in $XDG_CACHE_HOME or ~/.cache (%LOCALAPPDATA% on Windows) otherwise.
+    // The directory is created accessible only to the current user, and it is not used if it belongs to another user
+    // or can be written by others.
+    std::string defaultBinaryCacheDir();
+
     class Engine {
     public:
         const Device_ptr device;
 
-        Engine(Device_ptr device) : device(device), initialized(false) { }
+        Engine(Device_ptr device) : device(device), initialized(false), binaryCacheDir(defaultBinaryCacheDir()) { }
         ~Engine();
 
         bool init();
         bool ready() const;
 
+        // Compiled program binaries are cached on disk in binaryCacheDir (see defaultBinaryCacheDir), keyed on the device,
+        // its driver version, the source and the build options - so the next run of the application loads the binary
+        // instead of compiling the source. Any problem with the cache falls back to compilation from the source.
         bool compile(const char* source, size_t length, cl_program& program, const char* options=NULL) const;
         Kernel_ptr createKernel(cl_program program, const char* kernel_name) const;
         Kernel_ptr compileKernel(const char* source, size_t length, const char* kernel_name, const char* options=NULL) const;
@@ -33,10 +46,19 @@ namespace cl {
 
         void finish() const;
 
+        // empty directory disables the cache of program binaries
+        void setBinaryCacheDir(const std::string &dir) { binaryCacheDir = dir; }
+        const std::string &getBinaryCacheDir() const { return binaryCacheDir; }
+
     protected:
         cl_context context;
         cl_command_queue queue;
         bool initialized;
+        std::string binaryCacheDir;
+
+        std::string binaryCacheKey(const char* source, size_t length, const char* options) const;
+        bool loadCachedBinary(const std::string &key, cl_program& program, const char* options) const;
+        void saveCachedBinary(const std::string &key, cl_program program) const;
     };
 
     typedef std::shared_ptr<Engine> Engine_ptr;
@@ -57,4 +79,50 @@ namespace cl {
         std::shared_ptr<Engine> engine;
     };
 
+    // Buffers that are kept between calls: the buffer of each slot grows to the largest requested size and is reused afterwards.
+    // Not thread-safe (see SharedEngine::lock).
+    class BufferPool {
+    public:
+        BufferPool(const Engine &engine) : engine(engine) { }
+        ~BufferPool();
+
+        // buffer of at least size bytes (its contents are undefined)
+        cl_mem get(unsigned int slot, size_t size, cl_mem_flags flags=CL_MEM_READ_WRITE);
+
+        size_t allocatedSize() const;
+
+    protected:
+        struct Buffer {
+            cl_mem       buffer;
+            size_t       size;
+            cl_mem_flags flags;
+        };
+
+        const Engine &engine;
+        std::vector<Buffer> buffers;
+    };
+
+    // Engine of the device shared by the whole process with its pool of buffers and compiled kernels.
+    // Users hold the lock while they use the buffers and the kernels (arguments are set on shared kernel objects).
+    class SharedEngine {
+    public:
+        std::mutex lock;
+        const Engine_ptr engine;
+        BufferPool buffers;
+
+        SharedEngine(Engine_ptr engine) : engine(engine), buffers(*engine) { }
+
+        // compiles the kernel on the first request for the source, kernel name and options
+        Kernel_ptr kernel(const char* source, size_t length, const char* kernel_name, const char* options=NULL);
+
+    protected:
+        std::map<std::string, Kernel_ptr> kernels;
+    };
+
+    typedef std::shared_ptr<SharedEngine> SharedEngine_ptr;
+
+    // Engine of the device, created and initialized on the first request and kept until the process exits
+    // (nullptr if initialization failed), thread-safe
+    SharedEngine_ptr getSharedEngine(Device_ptr device);
+
 }
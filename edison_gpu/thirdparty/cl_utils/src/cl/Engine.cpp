@@ -1,6 +1,21 @@
 #include "cl/Engine.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
 
 static const bool VERBOSE_COMPILATION_LOG = VERBOSE;
 
@@ -50,6 +65,14 @@ bool Engine::compile(const char* source, size_t length, cl_program& program, con
     assert(ready());
     cl_int error_code;
 
+    std::string cache_key;
+    if (!binaryCacheDir.empty()) {
+        cache_key = binaryCacheKey(source, length, options);
+        if (loadCachedBinary(cache_key, program, options)) {
+            return true;
+        }
+    }
+
     cl_program new_program = clCreateProgramWithSource(context, 1, &source, &length, &error_code);
     CHECKED_FALSE(error_code);
     error_code = clBuildProgram(new_program, 1, &device->device_id, options, NULL, NULL);
@@ -67,12 +90,213 @@ bool Engine::compile(const char* source, size_t length, cl_program& program, con
         std::cerr << "Program building failed!\n" << std::endl;
     } else {
         CHECKED_FALSE(error_code);
+        if (!cache_key.empty()) {
+            saveCachedBinary(cache_key, new_program);
+        }
+    }
+
+    program = new_program;
+    return true;
+}
+
+// 64-bit FNV-1a
+static unsigned long long hashBytes(const char* data, size_t length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static std::string toHex(unsigned long long value) {
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return ss.str();
+}
+
+static std::string binaryCachePath(const std::string &dir, const std::string &key) {
+    return dir + "/" + toHex(hashBytes(key.data(), key.size())) + ".bin";
+}
+
+std::string cl::defaultBinaryCacheDir() {
+    const char* dir = getenv("CL_UTILS_BINARY_CACHE_DIR");
+    if (dir) {
+        return dir;
+    }
+    // per-user location, so that other users can not plant binaries
+#ifdef _WIN32
+    const char* cache_dir = getenv("LOCALAPPDATA");
+    if (!cache_dir || !*cache_dir) {
+        return "";
+    }
+    return std::string(cache_dir) + "/cl_utils_binary_cache";
+#else
+    const char* cache_dir = getenv("XDG_CACHE_HOME");
+    if (cache_dir && *cache_dir) {
+        return std::string(cache_dir) + "/cl_utils_binary_cache";
+    }
+    const char* home_dir = getenv("HOME");
+    if (!home_dir || !*home_dir) {
+        return "";
+    }
+    return std::string(home_dir) + "/.cache/cl_utils_binary_cache";
+#endif
+}
+
+// Creates the directory (accessible only to the current user) if it does not exist and checks that it is a directory
+// of the current user that no one else can write to - binaries from other directories are neither loaded nor saved
+static bool prepareBinaryCacheDir(const std::string &dir, bool create) {
+#ifdef _WIN32
+    struct _stat info;
+    if (_stat(dir.c_str(), &info) != 0) {
+        if (!create || _mkdir(dir.c_str()) != 0) {
+            return false;
+        }
+        return true;
+    }
+    return (info.st_mode & _S_IFDIR) != 0;
+#else
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0) {
+        if (!create) {
+            return false;
+        }
+        // parent directory of the default location (~/.cache) may be missing too
+        size_t slash = dir.find_last_of('/');
+        if (slash != std::string::npos && slash > 0) {
+            mkdir(dir.substr(0, slash).c_str(), 0700);
+        }
+        if (mkdir(dir.c_str(), 0700) != 0 || lstat(dir.c_str(), &info) != 0) {
+            return false;
+        }
+    }
+    if (!S_ISDIR(info.st_mode) || info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        verbose_cerr << "Binary cache directory " << dir << " is not a private directory of the current user, the cache is not used" << std::endl;
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Binary is valid only for the same device and driver, the hash of the source is enough to distinguish sources
+// (the whole key is stored in the file of the binary and is compared on loading, so collisions of file names are harmless)
+std::string Engine::binaryCacheKey(const char* source, size_t length, const char* options) const {
+    std::string driver_version;
+    size_t size = 0;
+    if (clGetDeviceInfo(device->device_id, CL_DRIVER_VERSION, 0, NULL, &size) == CL_SUCCESS && size > 0) {
+        driver_version.resize(size, ' ');
+        if (clGetDeviceInfo(device->device_id, CL_DRIVER_VERSION, size, (void *) driver_version.data(), &size) != CL_SUCCESS) {
+            driver_version.clear();
+        }
+        driver_version.resize(strlen(driver_version.c_str()));
+    }
+
+    std::stringstream ss;
+    ss << "platform: " << device->platform->name << "\n";
+    ss << "device: " << device->name << " (" << device->vendor << ")\n";
+    ss << "driver: " << driver_version << "\n";
+    ss << "options: " << (options ? options : "") << "\n";
+    ss << "source: " << toHex(hashBytes(source, length)) << " (" << length << " bytes)\n";
+    return ss.str();
+}
+
+bool Engine::loadCachedBinary(const std::string &key, cl_program& program, const char* options) const {
+    if (!prepareBinaryCacheDir(binaryCacheDir, false)) {
+        return false;
+    }
+    std::string path = binaryCachePath(binaryCacheDir, key);
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    unsigned long long key_length = 0;
+    unsigned long long binary_length = 0;
+    file.read((char *) &key_length, sizeof(key_length));
+    if (!file || key_length != key.size()) {
+        return false;
+    }
+    std::string file_key(key.size(), ' ');
+    file.read(&file_key[0], key.size());
+    file.read((char *) &binary_length, sizeof(binary_length));
+    if (!file || file_key != key || binary_length == 0) {
+        return false;
+    }
+    std::vector<unsigned char> binary(binary_length);
+    file.read((char *) binary.data(), binary_length);
+    if (!file) {
+        return false;
     }
 
+    const unsigned char* binary_data = binary.data();
+    size_t binary_size = binary.size();
+    cl_int binary_status = CL_SUCCESS;
+    cl_int error_code;
+    cl_program new_program = clCreateProgramWithBinary(context, 1, &device->device_id, &binary_size, &binary_data, &binary_status, &error_code);
+    if (error_code != CL_SUCCESS || binary_status != CL_SUCCESS) {
+        if (error_code == CL_SUCCESS) {
+            clReleaseProgram(new_program);
+        }
+        verbose_cout << "Cached program binary " << path << " was rejected by the driver" << std::endl;
+        return false;
+    }
+    error_code = clBuildProgram(new_program, 1, &device->device_id, options, NULL, NULL);
+    if (error_code != CL_SUCCESS) {
+        clReleaseProgram(new_program);
+        verbose_cout << "Cached program binary " << path << " failed to build" << std::endl;
+        return false;
+    }
+
+    verbose_cout << "Program binary loaded from " << path << std::endl;
     program = new_program;
     return true;
 }
 
+void Engine::saveCachedBinary(const std::string &key, cl_program program) const {
+    // single device per program
+    size_t binary_size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL) != CL_SUCCESS || binary_size == 0) {
+        return;
+    }
+    std::vector<unsigned char> binary(binary_size);
+    unsigned char* binary_data = binary.data();
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary_data), &binary_data, NULL) != CL_SUCCESS) {
+        return;
+    }
+
+    if (!prepareBinaryCacheDir(binaryCacheDir, true)) {
+        return;
+    }
+
+    // written to a temporary file and renamed, so that concurrent processes never see a partially written binary
+    std::string path = binaryCachePath(binaryCacheDir, key);
+    unsigned long long unique = (unsigned long long) std::chrono::steady_clock::now().time_since_epoch().count() ^ (unsigned long long) (size_t) this;
+    std::string temp_path = path + "." + toHex(unique) + ".tmp";
+    {
+        std::ofstream file(temp_path.c_str(), std::ios::binary);
+        if (!file) {
+            return;
+        }
+        unsigned long long key_length = key.size();
+        unsigned long long binary_length = binary.size();
+        file.write((const char *) &key_length, sizeof(key_length));
+        file.write(key.data(), key.size());
+        file.write((const char *) &binary_length, sizeof(binary_length));
+        file.write((const char *) binary.data(), binary.size());
+        if (!file) {
+            file.close();
+            remove(temp_path.c_str());
+            return;
+        }
+    }
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        return;
+    }
+    verbose_cout << "Program binary saved to " << path << std::endl;
+}
+
 Kernel_ptr Engine::createKernel(cl_program program, const char* kernel_name) const {
     cl_int error_code;
     cl_kernel kernel = clCreateKernel(program, kernel_name, &error_code);
@@ -138,3 +362,71 @@ Engine_ptr cl::createCPUEngine() {
         return Engine_ptr();
     }
 }
+
+BufferPool::~BufferPool() {
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i].buffer) {
+            clReleaseMemObject(buffers[i].buffer);
+        }
+    }
+}
+
+cl_mem BufferPool::get(unsigned int slot, size_t size, cl_mem_flags flags) {
+    if (slot >= buffers.size()) {
+        buffers.resize(slot + 1, Buffer{NULL, 0, 0});
+    }
+    Buffer &buffer = buffers[slot];
+    if (buffer.buffer && (buffer.size < size || buffer.flags != flags)) {
+        engine.deallocateBuffer(buffer.buffer);
+        buffer.buffer = NULL;
+    }
+    if (!buffer.buffer) {
+        buffer.size = std::max(size, buffer.size);
+        buffer.flags = flags;
+        buffer.buffer = engine.createBuffer(buffer.size, flags);
+    }
+    return buffer.buffer;
+}
+
+size_t BufferPool::allocatedSize() const {
+    size_t size = 0;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (buffers[i].buffer) {
+            size += buffers[i].size;
+        }
+    }
+    return size;
+}
+
+Kernel_ptr SharedEngine::kernel(const char* source, size_t length, const char* kernel_name, const char* options) {
+    std::string key = std::string(kernel_name) + "\n" + (options ? options : "") + "\n" + std::string(source, length);
+    auto it = kernels.find(key);
+    if (it != kernels.end()) {
+        return it->second;
+    }
+    Kernel_ptr kernel = engine->compileKernel(source, length, kernel_name, options);
+    if (kernel) {
+        kernels[key] = kernel;
+    }
+    return kernel;
+}
+
+SharedEngine_ptr cl::getSharedEngine(Device_ptr device) {
+    static std::mutex engines_lock;
+    // never destroyed: contexts are not released after OpenCL library is unloaded at exit
+    static std::map<cl_device_id, SharedEngine_ptr>* engines = new std::map<cl_device_id, SharedEngine_ptr>();
+
+    std::lock_guard<std::mutex> guard(engines_lock);
+    auto it = engines->find(device->device_id);
+    if (it != engines->end()) {
+        return it->second;
+    }
+
+    Engine_ptr engine(new Engine(device));
+    if (!engine->init()) {
+        return nullptr;
+    }
+    SharedEngine_ptr shared_engine(new SharedEngine(engine));
+    (*engines)[device->device_id] = shared_engine;
+    return shared_engine;
+}
@@ -25,10 +25,16 @@ int main(int argc, char **argv)
     int minArea = 200;
     SpeedUpLevel speedupLevel = AUTO_SPEEDUP;
 
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " <inputImageFilename> <outputImageFilename>" << std::endl;
+    if (argc != 3 && !(argc == 4 && (std::string(argv[3]) == "--validate" || std::string(argv[3]) == "--validate-pyramid" || std::string(argv[3]) == "--benchmark-gpu"))) {
+        std::cout << "Usage: " << argv[0] << " <inputImageFilename> <outputImageFilename> [--validate|--validate-pyramid|--benchmark-gpu]" << std::endl;
+        std::cout << "  --validate: compare single precision MULTITHREADED_FLOAT_SPEEDUP with double precision MULTITHREADED_SPEEDUP" << std::endl;
+        std::cout << "  --validate-pyramid: compare coarse-to-fine MULTITHREADED_PYRAMID_SPEEDUP with MULTITHREADED_SPEEDUP (iterations per pixel and deviation)" << std::endl;
+        std::cout << "  --benchmark-gpu: compare persistent threads GPU_PERSISTENT_SPEEDUP with GPU_SPEEDUP (set EDISON_GPU_OPENCL_DEVICE=cpu to use CPU OpenCL device)" << std::endl;
         return 1;
     }
+    bool validate = (argc == 4 && std::string(argv[3]) == "--validate");
+    bool validatePyramid = (argc == 4 && std::string(argv[3]) == "--validate-pyramid");
+    bool benchmarkGpu = (argc == 4 && std::string(argv[3]) == "--benchmark-gpu");
 
     std::string inputFilename(argv[1]);
     std::string outputFilename(argv[2]);
@@ -47,6 +53,25 @@ int main(int argc, char **argv)
         image = image.removeAlphaChannel();
     }
 
+    if (validate) {
+        std::cout << "Validating single precision filter..." << std::endl;
+        validateFilter(image.ptr(), image.width, image.height, image.cn, sigmaS, sigmaR, minArea,
+                       MULTITHREADED_FLOAT_SPEEDUP, MULTITHREADED_SPEEDUP, true);
+    }
+    if (validatePyramid) {
+        std::cout << "Validating coarse-to-fine filter..." << std::endl;
+        validateFilter(image.ptr(), image.width, image.height, image.cn, sigmaS, sigmaR, minArea,
+                       MULTITHREADED_PYRAMID_SPEEDUP, MULTITHREADED_SPEEDUP, true);
+    }
+    if (benchmarkGpu) {
+        std::cout << "Benchmarking persistent threads OpenCL kernel..." << std::endl;
+        // the first run compiles both kernels, so only the second one is timed
+        validateFilter(image.ptr(), image.width, image.height, image.cn, sigmaS, sigmaR, minArea,
+                       GPU_PERSISTENT_SPEEDUP, GPU_SPEEDUP, false);
+        validateFilter(image.ptr(), image.width, image.height, image.cn, sigmaS, sigmaR, minArea,
+                       GPU_PERSISTENT_SPEEDUP, GPU_SPEEDUP, true);
+    }
+
     performance_timer timer;
     SegmentedRegions regions = meanShiftSegmentation(image.ptr(), image.width, image.height, image.cn,
                                                      sigmaS, sigmaR, minArea, speedupLevel, true);